@@ -20,6 +20,16 @@
 #define __NORI_BVH_H
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <Eigen/StdVector>
+#include <memory>
+
+/* Number of triangles that are intersected at once by the leaf kernel */
+#if defined(__AVX__)
+#define NORI_TRIANGLE_GROUP_SIZE 8
+#else
+#define NORI_TRIANGLE_GROUP_SIZE 4
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,11 +48,50 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * Alternatively, the tree can be built much faster (at some cost in quality)
+ * by sorting the triangles along a Morton curve, either as a plain linear BVH
+ * (LBVH) or with a binned SAH build over clusters of triangles near the root
+ * (HLBVH), see \ref setBuildMethod().
+ *
+ * The binary tree can optionally be collapsed into a 4- or 8-wide BVH
+ * after construction (see \ref setBranchingFactor()). Wide nodes store the
+ * bounding boxes of all children in a structure-of-arrays layout, so that a
+ * single vectorized slab test intersects the ray against all of them at once.
+ *
+ * After construction, the triangles referenced by each leaf are copied into
+ * an accel-owned buffer of precomputed triangle records (first vertex and
+ * both edges), which are packed in groups of \ref NORI_TRIANGLE_GROUP_SIZE
+ * and intersected by a vectorized Moeller-Trumbore kernel. Leaves refer to
+ * ranges of these groups rather than to triangle indices.
+ *
  * \author Wenzel Jakob
  */
 class Accel {
     friend class BVHBuildTask;
+    friend class LBVHBuilder;
 public:
+    /// Available BVH construction algorithms
+    enum EBuildMethod {
+        /// Full binned/sweep SAH build (slowest, highest quality)
+        ESAHBuild = 0,
+        /// Linear BVH over Morton-sorted triangles (fastest)
+        ELBVHBuild,
+        /// LBVH with a binned SAH build of the top levels
+        EHLBVHBuild
+    };
+
+    /// Policies for the on-disk BVH cache (see \ref setCache())
+    enum ECachePolicy {
+        /// Never read or write cache files
+        ECacheOff = 0,
+        /// Use existing cache files, but never write new ones
+        ECacheReadOnly,
+        /// Use existing cache files, and write one after every build
+        ECacheReadWrite,
+        /// Ignore existing cache files, and overwrite them after every build
+        ECacheRefresh
+    };
+
     /// Create a new and empty BVH
     Accel() { m_meshOffset.push_back(0u); }
 
@@ -59,9 +108,65 @@ public:
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the BVH
+    /**
+     * \brief Set the branching factor of the BVH used for traversal
+     *
+     * Supported values are 2 (the binary SAH tree), 4 and 8. The
+     * wider variants are obtained by collapsing the binary tree in
+     * \ref build(). This function can only be used before \ref build()
+     * is called.
+     */
+    void setBranchingFactor(int width);
+
+    /// Return the branching factor of the BVH used for traversal
+    int getBranchingFactor() const { return m_width; }
+
+    /**
+     * \brief Set the algorithm used to construct the BVH
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setBuildMethod(EBuildMethod method) { m_buildMethod = method; }
+
+    /// Return the algorithm used to construct the BVH
+    EBuildMethod getBuildMethod() const { return m_buildMethod; }
+
+    /**
+     * \brief Store built trees in the given directory and reuse them
+     *
+     * Cache files are named after a hash of the mesh files (their path,
+     * size and modification time), their transformations and the build
+     * parameters, hence a changed scene or setting simply maps to a
+     * different file. The lookup happens before the meshes are loaded:
+     * when a matching file is found, \ref build() memory-maps it and the
+     * meshes use the vertex and index buffers stored in it in place,
+     * while the (much smaller) tree is copied out of the mapping.
+     * This function can only be used before \ref build() is called.
+     */
+    void setCache(const std::string &directory, ECachePolicy policy = ECacheReadWrite) {
+        m_cacheDirectory = directory;
+        m_cachePolicy = policy;
+    }
+
+    /**
+     * \brief Build the BVH
+     *
+     * This loads the geometry of the registered meshes, unless it is
+     * taken from a cache file (see \ref setCache())
+     */
     void build();
 
+    /**
+     * \brief Find the closest intersection of a ray with the triangle
+     * meshes registered with the BVH
+     *
+     * Only the compact \ref HitRecord is computed; use \ref
+     * computeIntersection() to obtain detailed information about it.
+     *
+     * \return \c true If an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, HitRecord &hit) const;
+
     /**
      * \brief Intersect a ray against all triangle meshes registered
      * with the BVH
@@ -73,13 +178,46 @@ public:
      * information is really needed. When set to \c true, the 
      * function just checks whether or not there is occlusion, but without
      * providing any more detail (i.e. \c its will not be filled with
-     * contents). This is usually much faster.
+     * contents). This is usually much faster, and equivalent to
+     * \ref occluded().
      *
      * \return \c true If an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Check whether a ray intersects any of the triangle meshes
+     * registered with the BVH
+     *
+     * Uses a dedicated traversal that visits larger children first and
+     * stops at the first intersection found, without ever computing the
+     * closest hit or touching an \ref Intersection record.
+     *
+     * \return \c true If an intersection was found
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a batch of \c n rays against all triangle meshes
+     * registered with the BVH
+     *
+     * The rays are sorted by direction and traced in packets that share a
+     * single traversal of the tree when they are coherent (e.g. neighboring
+     * camera rays), and one by one otherwise. The closest hit of each ray
+     * is stored in the corresponding entry of \c hits; entries of rays that
+     * did not intersect anything are invalid (see \ref HitRecord::isValid()).
+     *
+     * \return The number of rays that found an intersection
+     */
+    size_t rayIntersect(const Ray3f *rays, HitRecord *hits, size_t n) const;
+
+    /**
+     * \brief Compute the detailed intersection record (position, texture
+     * coordinates, and local frames) of a hit found by \ref rayIntersect()
+     */
+    void computeIntersection(const HitRecord &hit, Intersection &its) const;
+
     /// Return the total number of meshes registered with the BVH
     uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
 
@@ -108,21 +246,79 @@ protected:
         return (uint32_t) (it - m_meshOffset.begin());
     }
 
-    //// Return an axis-aligned bounding box containing the given triangle
-    BoundingBox3f getBoundingBox(uint32_t index) const {
-        uint32_t meshIdx = findMesh(index);
-        return m_meshes[meshIdx]->getBoundingBox(index);
+    //// Return an axis-aligned bounding box containing the given triangle (during construction)
+    const BoundingBox3f &getBoundingBox(uint32_t index) const {
+        return m_primBounds[index];
     }
     
-    //// Return the centroid of the given triangle
-    Point3f getCentroid(uint32_t index) const {
-        uint32_t meshIdx = findMesh(index);
-        return m_meshes[meshIdx]->getCentroid(index);
+    //// Return the centroid of the given triangle (during construction)
+    const Point3f &getCentroid(uint32_t index) const {
+        return m_centroids[index];
     }
 
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /// Compute the triangle offsets and bounding box of the loaded meshes
+    void updateMeshOffsets();
+
+    /**
+     * \brief Compute a hash of the mesh sources and build parameters
+     * identifying a cached tree
+     *
+     * Returns zero when one of the meshes cannot identify its source
+     * without loading it, in which case the tree is not cached.
+     */
+    uint64_t cacheKey() const;
+
+    /// Try to load a previously built tree and the mesh buffers from a cache file
+    bool loadCache(const std::string &filename, uint64_t key);
+
+    /// Write the built tree to a cache file
+    void saveCache(const std::string &filename, uint64_t key) const;
+
+    /// Collapse the binary BVH into a \c N-wide tree
+    template <int N> void collapse();
+
+    /// Pack the triangles of every leaf into groups and remap the leaf ranges
+    void packTriangles();
+
+    /// Intersect a ray against the triangle groups <tt>[start, start+count)</tt> of a leaf
+    bool intersectLeaf(Ray3f &ray, uint32_t start, uint32_t count,
+                       HitRecord &hit) const;
+
+    /// Check whether a ray intersects any of the triangle groups <tt>[start, start+count)</tt>
+    bool occludedLeaf(const Ray3f &ray, uint32_t start, uint32_t count) const;
+
+    /// Closest-hit traversal of the BVH with the configured branching factor
+    bool traverse(Ray3f &ray, HitRecord &hit) const;
+
+    /// Closest-hit traversal of the binary BVH
+    bool traverseBinary(Ray3f &ray, HitRecord &hit) const;
+
+    /// Closest-hit traversal of the collapsed \c N-wide BVH
+    template <int N> bool traverseWide(Ray3f &ray, HitRecord &hit) const;
+
+    /// Any-hit traversal of the binary BVH
+    bool occludedBinary(const Ray3f &ray) const;
+
+    /// Any-hit traversal of the collapsed \c N-wide BVH
+    template <int N> bool occludedWide(const Ray3f &ray) const;
+
+    /**
+     * \brief Closest-hit traversal of a packet of up to 32 rays with the same
+     * direction octant through the binary BVH (near child first)
+     * \return A mask of the rays that found an intersection
+     */
+    uint32_t traversePacketBinary(Ray3f *rays, HitRecord **hits, uint32_t count) const;
+
+    /**
+     * \brief Closest-hit traversal of a packet of up to 32 rays with the same
+     * direction octant through the \c N-wide BVH
+     * \return A mask of the rays that found an intersection
+     */
+    template <int N> uint32_t traversePacketWide(Ray3f *rays, HitRecord **hits, uint32_t count) const;
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -134,7 +330,9 @@ protected:
 
             struct {
                 unsigned flag : 1;
-                uint32_t axis : 31;
+                uint32_t axis : 2;
+                unsigned largerRight : 1;   ///< Does the right child have the larger surface area?
+                uint32_t unused : 28;
                 uint32_t rightChild;
             } inner;
 
@@ -162,11 +360,72 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief Collapsed BVH node with up to \c N children
+     *
+     * The child bounds are stored as structure-of-arrays (all minima
+     * along X, then along Y, ..) so that they can be tested against a
+     * ray in a single vectorized slab test. Unused slots have an empty
+     * bounding box, which never intersects any ray. Children are stored
+     * by decreasing surface area.
+     */
+    template <int N> struct WideBVHNode {
+        typedef Eigen::Array<float, N, 1> FloatN;
+
+        FloatN   bounds[6];   ///< min.x, min.y, min.z, max.x, max.y, max.z
+        uint32_t child[N];    ///< Wide node index (inner) or first triangle group (leaf)
+        uint32_t size[N];     ///< Number of triangle groups (leaf) or zero (inner)
+    };
+
+    /**
+     * \brief Precomputed records of \ref NORI_TRIANGLE_GROUP_SIZE triangles
+     *
+     * Stores the first vertex and the two edges of each triangle in a
+     * structure-of-arrays layout, along with the mesh and triangle index
+     * that the record was created from. Unused slots hold a degenerate
+     * triangle, which is always rejected by the intersection kernel.
+     */
+    struct TriangleGroup {
+        typedef Eigen::Array<float, NORI_TRIANGLE_GROUP_SIZE, 1> FloatK;
+        typedef Eigen::Array<bool, NORI_TRIANGLE_GROUP_SIZE, 1> BoolK;
+
+        FloatK   p0[3];                             ///< First vertex
+        FloatK   e1[3];                             ///< Edge from the first to the second vertex
+        FloatK   e2[3];                             ///< Edge from the first to the third vertex
+        uint32_t mesh[NORI_TRIANGLE_GROUP_SIZE];    ///< Mesh index
+        uint32_t prim[NORI_TRIANGLE_GROUP_SIZE];    ///< Triangle index within the mesh
+
+        /// Intersect a ray against all triangles of the group, returns the mask of hits
+        BoolK intersect(const Ray3f &ray, FloatK &u, FloatK &v, FloatK &t) const;
+    };
+
+    template <int N> using WideBVHNodeVector =
+        std::vector<WideBVHNode<N>, Eigen::aligned_allocator<WideBVHNode<N>>>;
+
+    /// Return the node storage of the \c N-wide BVH
+    template <int N> WideBVHNodeVector<N> &wideNodes();
+
+    /// Return the node storage of the \c N-wide BVH (const version)
+    template <int N> const WideBVHNodeVector<N> &wideNodes() const {
+        return const_cast<Accel *>(this)->wideNodes<N>();
+    }
 private:
     std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
-    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    WideBVHNodeVector<4> m_nodes4;      ///< Collapsed 4-wide BVH nodes
+    WideBVHNodeVector<8> m_nodes8;      ///< Collapsed 8-wide BVH nodes
+    int m_width = 2;                    ///< Branching factor used for traversal
+    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes (during construction)
+    std::vector<BoundingBox3f> m_primBounds; ///< Triangle bounding boxes (during construction)
+    std::vector<Point3f> m_centroids;   ///< Triangle centroids (during construction)
+    EBuildMethod m_buildMethod = ESAHBuild; ///< BVH construction algorithm
+    std::string m_cacheDirectory;       ///< Directory of cached trees
+    ECachePolicy m_cachePolicy = ECacheOff; ///< Policy for using cached trees
+    std::unique_ptr<MemoryMappedFile> m_cacheFile; ///< Mapped cache file holding the mesh buffers
+    std::vector<TriangleGroup, Eigen::aligned_allocator<TriangleGroup>>
+        m_triangles;                    ///< Leaf-ordered triangle records
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
 };
 
@@ -32,6 +32,32 @@ class Bitmap : public Eigen::Array<Color3f, Eigen::Dynamic, Eigen::Dynamic, Eige
 public:
     typedef Eigen::Array<Color3f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Base;
 
+    /// Compression methods for saving OpenEXR files
+    enum ECompression {
+        /// Store the pixels as they are
+        ENoCompression = 0,
+        /// Lossless zlib compression of 16 scanlines at a time (the OpenEXR default)
+        EZipCompression,
+        /// Lossless wavelet compression, usually best on noisy renders
+        EPizCompression,
+        /// Lossy DCT compression, much smaller files for final images
+        EDwaaCompression
+    };
+
+    /// Look up a compression method by name ("none", "zip", "piz", or "dwaa")
+    static ECompression compressionFromString(const std::string &name);
+
+    /// Return the name of a compression method
+    static std::string compressionToString(ECompression compression);
+
+    /**
+     * \brief Let OpenEXR compress and decompress files using
+     * as many threads as TBB uses for rendering
+     *
+     * Called automatically when loading and saving bitmaps
+     */
+    static void initThreadPool();
+
     /**
      * \brief Allocate a new bitmap of the specified size
      *
@@ -44,8 +70,16 @@ public:
     /// Load an OpenEXR file with the specified filename
     Bitmap(const std::string &filename);
 
-    /// Save the bitmap as an EXR file with the specified filename
-    void save(const std::string &filename);
+    /**
+     * \brief Save the bitmap as an EXR file with the specified filename
+     *
+     * \param compression
+     *     Compression method of the file
+     * \param halfFloat
+     *     Store 16 bit instead of 32 bit floating point channels
+     */
+    void save(const std::string &filename, ECompression compression = EZipCompression,
+              bool halfFloat = false);
 };
 
 NORI_NAMESPACE_END
@@ -25,8 +25,13 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define NORI_BLOCK_STRIPES 64 /* Number of row locks used when merging blocks */
+#define NORI_MAX_SPLAT_WIDTH 32 /* Maximum filter footprint (in pixels along each axis) */
 
 NORI_NAMESPACE_BEGIN
 
@@ -46,6 +51,14 @@ NORI_NAMESPACE_BEGIN
  */
 class ImageBlock : public Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> {
 public:
+    typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Base;
+
+    /// Rectangle of pixels within the visible part of the block
+    struct Region {
+        Point2i offset;
+        Vector2i size;
+    };
+
     /**
      * Create a new image block of the specified maximum size
      * \param size
@@ -88,79 +101,169 @@ public:
     /// Clear all contents
     void clear() { setConstant(Color4f()); }
 
-    /// Record a sample with the given position and radiance value
+    /**
+     * \brief Record a sample with the given position and radiance value
+     *
+     * Invalid values (NaN, infinite, or negative) are discarded. Only the
+     * first one triggers a warning, the others are merely counted
+     * (see \ref getInvalidSampleCount()).
+     */
     void put(const Point2f &pos, const Color3f &value);
 
     /**
      * \brief Merge another image block into this one
      *
-     * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * Pixels that no other block can touch are added without any
+     * locking. The surrounding ring (twice the filter border wide), which
+     * overlaps with neighboring blocks, is merged row by row while holding
+     * one of \ref NORI_BLOCK_STRIPES row locks. This requires that the
+     * blocks merged concurrently do not overlap, which is the case for
+     * the output of \ref BlockGenerator.
      */
     void put(ImageBlock &b);
 
-    /// Lock the image block (using an internal mutex)
-    inline void lock() const { m_mutex.lock(); }
-    
-    /// Unlock the image block
-    inline void unlock() const { m_mutex.unlock(); }
+    /**
+     * \brief Collect the regions changed by \ref put(ImageBlock &) since
+     * the last call, e.g. to refresh a preview window
+     *
+     * Changes are tracked in tiles of \ref NORI_BLOCK_SIZE pixels, and
+     * neighboring changed tiles of a row are returned as one region.
+     * This function is thread-safe.
+     */
+    void takeDirtyRegions(std::vector<Region> &regions) const;
+
+    /**
+     * \brief Copy a region of the visible part of the block (without the
+     * border) into the tightly packed array \c target
+     *
+     * Each row is copied while holding its row lock, so concurrent
+     * merges are held up for at most one row. Pixels that are being
+     * written without locking may be read while partially merged.
+     */
+    void snapshot(const Region &region, Color4f *target) const;
+
+    /**
+     * \brief Write the accumulated pixel values and weights (including
+     * the border) to a checkpoint file
+     *
+     * \param filename
+     *     Name of the checkpoint file. It is replaced atomically.
+     * \param key
+     *     Identifies the render (e.g. a hash of the scene description)
+     * \param sampleCount
+     *     Number of samples per pixel accumulated so far
+     */
+    void saveCheckpoint(const std::string &filename, uint64_t key, uint32_t sampleCount) const;
+
+    /**
+     * \brief Restore the contents of a checkpoint written by \ref saveCheckpoint()
+     *
+     * \return The number of samples per pixel stored in the checkpoint, or
+     *     zero if the file does not exist or belongs to a different render
+     */
+    uint32_t loadCheckpoint(const std::string &filename, uint64_t key);
+
+    /// Return the number of invalid samples discarded by \ref put() so far
+    static size_t getInvalidSampleCount() { return m_invalidSamples; }
 
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /**
+     * \brief Splat a sample into a square footprint of \c Width pixels
+     * (or \ref m_splatWidth when \c Width is zero)
+     *
+     * The footprint is shifted to lie entirely within the block, which
+     * avoids clipping. Its pixels outside the filter support receive a
+     * weight of zero.
+     */
+    template <int Width> void splat(const Point2f &pos, const Color3f &value);
+
     Point2i m_offset;
     Vector2i m_size;
     int m_borderSize = 0;
     float *m_filter = nullptr;
     float m_filterRadius = 0;
-    float *m_weightsX = nullptr;
-    float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
-    mutable tbb::mutex m_mutex;
+    int m_splatWidth = 0;
+    bool m_splatPixel = false;
+    static std::atomic<size_t> m_invalidSamples;
+    mutable tbb::mutex m_stripes[NORI_BLOCK_STRIPES];
+    Vector2i m_dirtyTiles;
+    std::unique_ptr<std::atomic<bool>[]> m_dirty;
 };
 
 /**
- * \brief Spiraling block generator
+ * \brief Lock-free block generator
  *
  * This class can be used to chop up an image into many small
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
- * rendered first.
+ * rendered first, or along a Hilbert curve for better coherence
+ * between consecutive blocks.
+ *
+ * The order is computed once up front, and blocks are handed out by
+ * atomically incrementing a cursor. The last few blocks of the frame are
+ * split into quarters, so that all threads remain busy until the end.
  */
 class BlockGenerator {
 public:
+    /// Order in which the blocks are rendered
+    enum EOrder {
+        ESpiral = 0,
+        EHilbert
+    };
+
     /**
      * \brief Create a block generator with
      * \param size
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param order
+     *      Order in which the blocks are generated
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
+    BlockGenerator(const Vector2i &size, int blockSize, EOrder order = ESpiral);
     
     /**
      * \brief Return the next block to be rendered
      *
-     * This function is thread-safe
+     * This function is thread-safe and lock-free
      *
      * \return \c false if there were no more blocks
      */
     bool next(ImageBlock &block);
 
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Start over with the first block (e.g. for another pass over the image)
+    void reset() { m_cursor = 0; }
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
+    /// Append the blocks of the image in spiraling order
+    void generateSpiral();
+
+    /// Append the blocks of the image in the order of a Hilbert curve
+    void generateHilbert();
+
+    /// Split the last blocks into quarters to balance the end of the frame
+    void splitTail();
+
+    /// Append the block with the given index (in units of the block size)
+    void addBlock(const Point2i &block);
+
+    struct Block {
+        Point2i offset;
+        Vector2i size;
+    };
+
     Vector2i m_numBlocks;
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    std::vector<Block> m_blocks;
+    std::atomic<int> m_cursor;
 };
 
 NORI_NAMESPACE_END
@@ -20,6 +20,13 @@
 
 #include <nori/object.h>
 
+/* Number of query records that are processed at once by the batched BSDF kernels */
+#if defined(__AVX__)
+#define NORI_BSDF_PACKET_SIZE 8
+#else
+#define NORI_BSDF_PACKET_SIZE 4
+#endif
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -49,6 +56,67 @@ struct BSDFQueryRecord {
         : wi(wi), wo(wo), measure(measure) { }
 };
 
+/**
+ * \brief Up to \ref NORI_BSDF_PACKET_SIZE query records in a
+ * structure-of-arrays layout, used by the batched BSDF kernels
+ *
+ * Unused lanes hold the normal direction and are never written back.
+ */
+struct BSDFQueryPacket {
+    typedef Eigen::Array<float, NORI_BSDF_PACKET_SIZE, 1> FloatP;
+    typedef Eigen::Array<bool, NORI_BSDF_PACKET_SIZE, 1> BoolP;
+
+    FloatP wi[3];       ///< Incident directions (in the local frame)
+    FloatP wo[3];       ///< Outgoing directions (in the local frame)
+    FloatP sample[2];   ///< Uniformly distributed samples (when sampling)
+    BoolP solidAngle;   ///< Is the measure of the query \ref ESolidAngle?
+    size_t size;        ///< Number of lanes in use
+
+    /// Gather the directions and measures of up to \ref NORI_BSDF_PACKET_SIZE records
+    void load(const BSDFQueryRecord *bRecs, size_t count) {
+        size = std::min(count, (size_t) NORI_BSDF_PACKET_SIZE);
+        for (size_t k=0; k<NORI_BSDF_PACKET_SIZE; ++k) {
+            const Vector3f wi_ = k < size ? bRecs[k].wi : Vector3f(0.0f, 0.0f, 1.0f);
+            const Vector3f wo_ = k < size ? bRecs[k].wo : Vector3f(0.0f, 0.0f, 1.0f);
+            for (int j=0; j<3; ++j) {
+                wi[j][k] = wi_[j];
+                wo[j][k] = wo_[j];
+            }
+            solidAngle[k] = k < size && bRecs[k].measure == ESolidAngle;
+        }
+    }
+
+    /// Gather the incident directions and samples of up to \ref NORI_BSDF_PACKET_SIZE records
+    void loadIncident(const BSDFQueryRecord *bRecs, const Point2f *samples, size_t count) {
+        size = std::min(count, (size_t) NORI_BSDF_PACKET_SIZE);
+        for (size_t k=0; k<NORI_BSDF_PACKET_SIZE; ++k) {
+            const Vector3f wi_ = k < size ? bRecs[k].wi : Vector3f(0.0f, 0.0f, 1.0f);
+            const Point2f sample_ = k < size ? samples[k] : Point2f(0.5f, 0.5f);
+            for (int j=0; j<3; ++j)
+                wi[j][k] = wi_[j];
+            sample[0][k] = sample_.x();
+            sample[1][k] = sample_.y();
+        }
+        solidAngle.setConstant(false);
+    }
+
+    /// Vectorized version of \ref Warp::squareToCosineHemisphere()
+    static void squareToCosineHemisphere(const FloatP &u, const FloatP &v, FloatP *w) {
+        /* Concentric mapping of the square onto the disk */
+        FloatP r1 = 2.0f * u - 1.0f, r2 = 2.0f * v - 1.0f;
+        BoolP first = r1*r1 > r2*r2, zero = (r1 == 0.0f) && (r2 == 0.0f);
+        FloatP r = zero.select(FloatP::Zero(), first.select(r1, r2));
+        FloatP phi = zero.select(FloatP::Zero(), first.select(
+            (M_PI / 4.0f) * (r2 / r1),
+            (M_PI / 2.0f) - (r1 / r2) * (M_PI / 4.0f)));
+
+        /* Project up onto the hemisphere, guarding against numerical imprecisions */
+        w[0] = r * phi.cos();
+        w[1] = r * phi.sin();
+        w[2] = (1.0f - w[0]*w[0] - w[1]*w[1]).max(0.0f).sqrt().max(1e-5f);
+    }
+};
+
 /**
  * \brief Superclass of all bidirectional scattering distribution functions
  */
@@ -110,6 +178,38 @@ public:
      * or not to store photons on a surface
      */
     virtual bool isDiffuse() const { return false; }
+
+    /**
+     * \brief Sample the BSDF for a batch of query records
+     *
+     * Equivalent to calling \ref sample() for each record, but costs a
+     * single virtual call. Subclasses may override this function with
+     * kernels that process \ref NORI_BSDF_PACKET_SIZE records at once.
+     *
+     * \param bRecs    Query records, whose \c wi fields are set
+     * \param samples  A uniformly distributed sample on \f$[0,1]^2\f$ per record
+     * \param values   Receives the importance weight of each sample
+     * \param count    Number of records
+     */
+    virtual void sampleBatch(BSDFQueryRecord *bRecs, const Point2f *samples,
+                             Color3f *values, size_t count) const {
+        for (size_t i=0; i<count; ++i)
+            values[i] = sample(bRecs[i], samples[i]);
+    }
+
+    /// Evaluate the BSDF for a batch of query records (see \ref eval())
+    virtual void evalBatch(const BSDFQueryRecord *bRecs, Color3f *values,
+                           size_t count) const {
+        for (size_t i=0; i<count; ++i)
+            values[i] = eval(bRecs[i]);
+    }
+
+    /// Compute the sampling density for a batch of query records (see \ref pdf())
+    virtual void pdfBatch(const BSDFQueryRecord *bRecs, float *pdfs,
+                          size_t count) const {
+        for (size_t i=0; i<count; ++i)
+            pdfs[i] = pdf(bRecs[i]);
+    }
 };
 
 NORI_NAMESPACE_END
@@ -125,6 +125,8 @@ class BlockGenerator;
 class Camera;
 class ImageBlock;
 class Integrator;
+struct Intersection;
+struct HitRecord;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
@@ -144,6 +146,8 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+typedef Eigen::Map<const MatrixXf>                             MatrixXfMap;
+typedef Eigen::Map<const MatrixXu>                             MatrixXuMap;
 
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
@@ -195,4 +195,141 @@ private:
     bool m_normalized;
 };
 
+/**
+ * \brief Discrete probability distribution that can be
+ * sampled in constant time
+ *
+ * Unlike \ref DiscretePDF, which performs a binary search over the
+ * cumulative distribution, this class uses Walker's alias method: every
+ * entry of the table is split between its own index and one "alias".
+ * This makes it suitable for distributions with many entries, such as
+ * the emissive triangles of a scene.
+ */
+struct DiscreteAliasPDF {
+public:
+    /**
+     * \brief Build the table for the given (unnormalized) weights
+     *
+     * \return Sum of the weights
+     */
+    float build(const std::vector<float> &weights) {
+        size_t n = weights.size();
+        m_entries.resize(n);
+        m_sum = 0.0f;
+        for (float weight : weights)
+            m_sum += weight;
+        if (n == 0 || m_sum <= 0) {
+            m_entries.clear();
+            return m_sum;
+        }
+
+        /* Vose's algorithm: pair up entries below and above the mean */
+        std::vector<uint32_t> small, large;
+        std::vector<float> scaled(n);
+        for (size_t i=0; i<n; ++i) {
+            m_entries[i].pdf = weights[i] / m_sum;
+            scaled[i] = m_entries[i].pdf * n;
+            (scaled[i] < 1.0f ? small : large).push_back((uint32_t) i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            m_entries[s].threshold = scaled[s];
+            m_entries[s].alias = l;
+            scaled[l] -= 1.0f - scaled[s];
+            if (scaled[l] < 1.0f) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        /* What remains has a probability of one (up to roundoff) */
+        for (uint32_t i : small) {
+            m_entries[i].threshold = 1.0f;
+            m_entries[i].alias = i;
+        }
+        for (uint32_t i : large) {
+            m_entries[i].threshold = 1.0f;
+            m_entries[i].alias = i;
+        }
+        return m_sum;
+    }
+
+    /// Return the number of entries (zero if all weights were zero)
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    /// Return the probability of an entry
+    float operator[](size_t entry) const {
+        return m_entries[entry].pdf;
+    }
+
+    /// Return the original (unnormalized) sum of all weights
+    float getSum() const {
+        return m_sum;
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * \param[in] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sample(float sampleValue, float &pdf) const {
+        return sampleReuse(sampleValue, pdf);
+    }
+
+    /**
+     * \brief %Transform a uniformly distributed sample to the stored distribution
+     *
+     * The original sample is value adjusted so that it can be "reused".
+     * Only few bits of it are left with large tables, so prefer drawing
+     * a new sample in this case.
+     *
+     * \param[in,out] sampleValue
+     *     An uniformly distributed sample on [0,1]
+     * \param[out] pdf
+     *     Probability value of the sample
+     * \return
+     *     The discrete index associated with the sample
+     */
+    size_t sampleReuse(float &sampleValue, float &pdf) const {
+        float value = sampleValue * m_entries.size();
+        size_t index = std::min((size_t) value, m_entries.size() - 1);
+        const Entry &entry = m_entries[index];
+        /* Keep the position within the entry below one, where entries
+           with a threshold of one would otherwise divide zero by zero */
+        value = std::min(value - index, 1.0f - std::numeric_limits<float>::epsilon());
+
+        if (value < entry.threshold) {
+            sampleValue = value / entry.threshold;
+        } else {
+            sampleValue = std::min((value - entry.threshold) / (1.0f - entry.threshold),
+                                   1.0f - std::numeric_limits<float>::epsilon());
+            index = entry.alias;
+        }
+        pdf = m_entries[index].pdf;
+        return index;
+    }
+
+    /// Return a human-readable summary
+    std::string toString() const {
+        return tfm::format("DiscreteAliasPDF[size=%i, sum=%f]", m_entries.size(), m_sum);
+    }
+private:
+    struct Entry {
+        float threshold;        ///< Probability of keeping this index (times the size)
+        uint32_t alias;         ///< Index to choose otherwise
+        float pdf;              ///< Normalized probability of this index
+    };
+    std::vector<Entry> m_entries;
+    float m_sum = 0.0f;
+};
+
 NORI_NAMESPACE_END
@@ -19,20 +19,120 @@
 #pragma once
 
 #include <nori/object.h>
+#include <nori/ray.h>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Convenience data structure used to pass multiple
+ * parameters to the evaluation and sampling routines in \ref Emitter
+ */
+struct EmitterQueryRecord {
+    /// Emitter that was sampled or hit
+    const Emitter *emitter;
+    /// Index of the triangle of the emitter's mesh that contains \c p
+    uint32_t triangle;
+    /// Point that receives the emitted light
+    Point3f ref;
+    /// Position on the emitter
+    Point3f p;
+    /// Surface normal of the emitter at \c p
+    Normal3f n;
+    /// Direction from \c ref towards \c p (normalized)
+    Vector3f wi;
+    /// Density of \c p with respect to solid angles at \c ref
+    float pdf;
+    /// Segment from \c ref to \c p, for testing visibility
+    Ray3f shadowRay;
+
+    /// Create a new record for sampling an emitter
+    EmitterQueryRecord(const Point3f &ref)
+        : emitter(nullptr), triangle((uint32_t) -1), ref(ref), pdf(0.0f) { }
+
+    /// Create a new record for querying an emitter whose triangle \c triangle was hit at \c p
+    EmitterQueryRecord(const Emitter *emitter, uint32_t triangle, const Point3f &ref,
+                       const Point3f &p, const Normal3f &n)
+        : emitter(emitter), triangle(triangle), ref(ref), pdf(0.0f) {
+        setPosition(p, n);
+    }
+
+    /// Set the position on the emitter, and update \c wi and \c shadowRay
+    void setPosition(const Point3f &p, const Normal3f &n) {
+        this->p = p;
+        this->n = n;
+        Vector3f d = p - ref;
+        float distance = d.norm();
+        wi = d / distance;
+        shadowRay = Ray3f(ref, wi, Epsilon, distance * (1.0f - Epsilon));
+    }
+
+    /**
+     * \brief Convert a density with respect to surface area at \c p
+     * into one with respect to solid angles at \c ref
+     *
+     * Returns zero when \c p faces away from \c ref.
+     */
+    float toSolidAngle(float pdfArea) const {
+        float cosTheta = -n.dot(wi);
+        if (cosTheta <= 0)
+            return 0.0f;
+        return pdfArea * (p - ref).squaredNorm() / cosTheta;
+    }
+};
+
 /**
  * \brief Superclass of all emitters
  */
 class Emitter : public NoriObject {
 public:
+    /**
+     * \brief Sample a position on the emitter that illuminates \c lRec.ref
+     *
+     * \param lRec
+     *     A record whose \c ref field is set. On return, it describes
+     *     the sampled position and its density.
+     * \param sample
+     *     A uniformly distributed sample on \f$[0,1]^2\f$
+     * \return
+     *     The emitted radiance divided by the density of the sample
+     *     (zero if sampling failed). Visibility is not taken into account.
+     */
+    virtual Color3f sample(EmitterQueryRecord &lRec, const Point2f &sample) const = 0;
+
+    /**
+     * \brief Evaluate the radiance emitted from \c lRec.p
+     * towards \c lRec.ref
+     */
+    virtual Color3f eval(const EmitterQueryRecord &lRec) const = 0;
+
+    /**
+     * \brief Compute the density of \ref sample() generating \c lRec.p,
+     * with respect to solid angles at \c lRec.ref
+     */
+    virtual float pdf(const EmitterQueryRecord &lRec) const = 0;
+
+    /**
+     * \brief Return the emitted radiance, averaged over the emitter
+     *
+     * Used to choose among the emitters of a scene in proportion
+     * to the power they emit.
+     */
+    virtual Color3f getRadiance() const = 0;
+
+    /// Attach the emitter to a mesh (called by \ref Mesh::addChild())
+    void setMesh(const Mesh *mesh) { m_mesh = mesh; }
+
+    /// Return the mesh of an area emitter (or \c nullptr)
+    const Mesh *getMesh() const { return m_mesh; }
 
     /**
      * \brief Return the type of object (i.e. Mesh/Emitter/etc.) 
      * provided by this instance
      * */
     EClassType getClassType() const { return EEmitter; }
+
+protected:
+    const Mesh *m_mesh = nullptr;
 };
 
 NORI_NAMESPACE_END
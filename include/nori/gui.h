@@ -18,23 +18,48 @@
 
 #pragma once
 
-#include <nori/common.h>
+#include <nori/block.h>
+#include <nori/timer.h>
 #include <nanogui/screen.h>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Preview window that shows a (partially rendered) image block
+ *
+ * Only the tiles that changed since the last refresh are copied to the
+ * GPU, through a pixel buffer object.
+ */
 class NoriScreen : public nanogui::Screen {
 public:
-    NoriScreen(const ImageBlock &block);
+    /**
+     * \param block
+     *     Image block to be shown
+     * \param refreshRate
+     *     Maximum number of times per second the image is uploaded to the GPU
+     * \param halfFloat
+     *     Upload normalized half precision instead of single precision pixels,
+     *     which halves the transfer size
+     */
+    NoriScreen(const ImageBlock &block, float refreshRate = 20.f, bool halfFloat = false);
     virtual ~NoriScreen();
 
     void drawContents();
 private:
+    /// Copy the given regions of the image block into the texture
+    void upload(const std::vector<ImageBlock::Region> &regions);
+
     const ImageBlock &m_block;
+    std::vector<ImageBlock::Region> m_regions;
+    std::vector<Color4f, Eigen::aligned_allocator<Color4f>> m_staging;
     nanogui::GLShader *m_shader = nullptr;
     nanogui::Slider *m_slider = nullptr;
     uint32_t m_texture = 0;
+    uint32_t m_buffer = 0;
     float m_scale = 1.f;
+    float m_refreshInterval = 0.f;
+    bool m_halfFloat = false;
+    Timer m_refreshTimer;
 };
 
 NORI_NAMESPACE_END
@@ -22,6 +22,9 @@
 
 NORI_NAMESPACE_BEGIN
 
+struct PathState;
+struct ShadowRay;
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -53,6 +56,48 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose
+     * first intersection has already been computed
+     *
+     * The renderer traces camera rays in batches (see \ref
+     * Scene::rayIntersect()) and passes the result to this function.
+     * Integrators can override it to skip the redundant first
+     * intersection query, and call \ref Scene::computeSurfaceInteraction()
+     * only if they need more than the distance or mesh of the hit. The
+     * default implementation ignores \c hit and calls \ref Li().
+     *
+     * \param hit
+     *    The first intersection along \c ray. It is invalid
+     *    when the ray did not intersect anything.
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                              const HitRecord &hit) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Does the integrator implement \ref shade() (needed by wavefront rendering)?
+    virtual bool supportsWavefront() const { return false; }
+
+    /**
+     * \brief Shade the next vertex of a batch of paths (wavefront rendering)
+     *
+     * The \ref WavefrontRenderer calls this function with groups of paths
+     * whose next vertex (\c PathState::hit) lies on the same mesh. For
+     * each path, the integrator accounts for the emission at the vertex,
+     * may append one shadow ray to \c shadowRays, and either samples the
+     * next ray of the path or clears \c PathState::alive. Samples must be
+     * requested via \ref Sampler::setSample() using the pixel, sample
+     * index and dimension stored in the path.
+     *
+     * The default implementation throws an exception.
+     */
+    virtual void shade(const Scene *scene, Sampler *sampler, PathState *paths,
+                       size_t count, std::vector<ShadowRay> &shadowRays) const {
+        throw NoriException("Integrator::shade(): wavefront rendering is not "
+            "supported by this integrator!");
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
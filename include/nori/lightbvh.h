@@ -0,0 +1,160 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/emitter.h>
+#include <nori/bbox.h>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Spatial and directional bounds of a set of emissive triangles
+ *
+ * Stores the bounding box of the triangles, their total emitted power,
+ * and a cone that contains all of their normals. Since area emitters are
+ * diffuse, every triangle emits into the hemisphere around its normal.
+ */
+struct LightBounds {
+    /// Bounding box of the triangles
+    BoundingBox3f bbox;
+    /// Axis of the cone that bounds the normals
+    Vector3f axis;
+    /// Half-angle of the cone that bounds the normals (negative: no triangles)
+    float theta;
+    /// Total emitted power of the triangles
+    float power;
+
+    /// Create empty bounds
+    LightBounds() : axis(0.0f, 0.0f, 1.0f), theta(-1.0f), power(0.0f) { }
+
+    /// Do the bounds contain any triangles?
+    bool isValid() const { return theta >= 0; }
+
+    /// Expand the bounds to contain another set of triangles
+    void expandBy(const LightBounds &bounds);
+
+    /// Merge two bounds
+    static LightBounds merge(const LightBounds &bounds1, const LightBounds &bounds2) {
+        LightBounds result(bounds1);
+        result.expandBy(bounds2);
+        return result;
+    }
+
+    /**
+     * \brief Estimate the contribution of the triangles to the point \c ref
+     *
+     * The estimate accounts for the power, distance and orientation of the
+     * triangles. It is conservative: zero is only returned when none of
+     * the triangles can illuminate \c ref.
+     */
+    float importance(const Point3f &ref) const;
+
+    /**
+     * \brief Return a measure of the set of directions that the
+     * triangles emit into (used by the construction heuristic)
+     */
+    float getOrientationMeasure() const;
+
+    /// Return a human-readable summary
+    std::string toString() const;
+};
+
+/**
+ * \brief Bounding volume hierarchy over the emissive triangles of a scene
+ *
+ * Every node stores the \ref LightBounds of its subtree. An emitter is
+ * chosen by descending the tree from the root, where each step picks one
+ * of the two children with a probability proportional to its estimated
+ * contribution to the shading point. Unlike choosing emitters by power
+ * alone, this takes the distance and orientation of the emitters into
+ * account, which matters greatly in scenes with many small lights. For
+ * details, refer to the paper
+ *
+ * "Importance Sampling of Many Lights with Adaptive Tree Splitting"
+ * by Alejandro Conty Estevez and Christopher Kulla (Proc. HPG 2018)
+ *
+ * The tree is constructed top-down using the same parallel binned
+ * strategy as \ref Accel, where the surface area heuristic is extended
+ * by the power and orientation bounds of the children (SAOH). Every
+ * leaf contains a single triangle.
+ */
+class LightBVH {
+    friend class LightBVHBuilder;
+public:
+    /// Create an empty hierarchy
+    LightBVH() { }
+
+    /// Build the hierarchy over all emissive triangles of the given meshes
+    void build(const std::vector<Mesh *> &meshes);
+
+    /// Return the number of emissive triangles
+    uint32_t getTriangleCount() const { return (uint32_t) m_triangles.size(); }
+
+    /**
+     * \brief Sample a position on one of the emissive triangles
+     *
+     * \param lRec
+     *     A record whose \c ref field is set. On return, it describes
+     *     the sampled position and its density.
+     * \param selection
+     *     A uniformly distributed sample on \f$[0,1]\f$ that guides the
+     *     descent to a triangle
+     * \param sample
+     *     A uniformly distributed sample on \f$[0,1]^2\f$ that chooses the
+     *     position within the triangle
+     * \return
+     *     The emitted radiance divided by the density of the sample
+     *     (zero if sampling failed, or if there are no emitters).
+     *     Visibility is not taken into account.
+     */
+    Color3f sample(EmitterQueryRecord &lRec, float selection, const Point2f &sample) const;
+
+    /**
+     * \brief Compute the density of \ref sample() generating the position
+     * \c lRec.p on triangle \c lRec.triangle of \c lRec.emitter, with
+     * respect to solid angles at \c lRec.ref
+     */
+    float pdf(const EmitterQueryRecord &lRec) const;
+
+    /// Return a human-readable summary
+    std::string toString() const;
+
+protected:
+    /// Hierarchy node in depth-first order (the left child follows its parent)
+    struct LightBVHNode {
+        LightBounds bounds;     ///< Bounds of all triangles in the subtree
+        uint32_t parent;        ///< Index of the parent node (root: <tt>(uint32_t) -1</tt>)
+        uint32_t child;         ///< Index of the right child (inner) or triangle (leaf)
+        bool leaf;              ///< Is this a leaf node?
+    };
+
+    /// Return the probability of choosing the given child of an inner node
+    float childProbability(const Point3f &ref, uint32_t parent, uint32_t child) const;
+
+private:
+    std::vector<LightBVHNode> m_nodes;  ///< Hierarchy nodes
+    std::vector<std::pair<const Mesh *, uint32_t>>
+        m_triangles;                    ///< Emissive triangles (mesh and triangle index)
+    std::vector<uint32_t> m_leaves;     ///< Leaf node of every emissive triangle
+    std::unordered_map<const Mesh *, uint32_t>
+        m_meshOffset;                   ///< Index of the first emissive triangle of each mesh
+};
+
+NORI_NAMESPACE_END
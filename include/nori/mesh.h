@@ -66,6 +66,31 @@ struct Intersection {
     std::string toString() const;
 };
 
+/**
+ * \brief Compact record of a ray-triangle intersection
+ *
+ * This is what ray traversal produces: just enough information to
+ * identify the closest hit. The full \ref Intersection record can be
+ * computed from it on demand (see \ref Scene::computeSurfaceInteraction()).
+ */
+struct HitRecord {
+    /// Unoccluded distance along the ray
+    float t;
+    /// Index of the intersected mesh in the scene, or <tt>(uint32_t) -1</tt>
+    uint32_t mesh;
+    /// Index of the intersected triangle within the mesh
+    uint32_t prim;
+    /// Barycentric coordinates of the second and third vertex
+    Point2f bary;
+
+    /// Create an invalid hit record
+    HitRecord() : t(std::numeric_limits<float>::infinity()),
+        mesh((uint32_t) -1), prim((uint32_t) -1), bary(0.0f, 0.0f) { }
+
+    /// Does this record refer to an actual intersection?
+    bool isValid() const { return mesh != (uint32_t) -1; }
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -82,6 +107,40 @@ public:
     /// Initialize internal data structures (called once by the XML parser)
     virtual void activate();
 
+    /**
+     * \brief Load the vertex and index buffers, and initialize the data
+     * structures that depend on them (called once by \ref Accel::build())
+     *
+     * Mesh plugins defer reading their files until this point, so that
+     * a cached copy of the buffers can be used instead (see \ref restore()).
+     * The geometry of the mesh may only be queried after this function (or
+     * \ref restore()) was called. Further calls have no effect.
+     */
+    void load();
+
+    /**
+     * \brief Make the mesh use the given buffers instead of loading them
+     *
+     * The buffers are used in place (see \ref setBuffers()). This is how
+     * \ref Accel restores meshes from its cache.
+     */
+    void restore(const float *V, const float *N, const float *UV,
+                 const uint32_t *F, uint32_t vertexCount, uint32_t triangleCount,
+                 const BoundingBox3f &bbox);
+
+    /// Have the buffers of the mesh been loaded?
+    bool isLoaded() const { return m_loaded; }
+
+    /**
+     * \brief Return a string that identifies the contents of the mesh
+     * without loading it, or an empty string if this is not possible
+     *
+     * File-based meshes combine the path, size and modification time of
+     * the file with their parameters. \ref Accel uses this string to look
+     * up cached trees before any mesh is loaded.
+     */
+    virtual std::string getSourceID() const { return ""; }
+
     /// Return the total number of triangles in this hsape
     uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
 
@@ -91,12 +150,25 @@ public:
     /**
      * \brief Uniformly sample a position on the mesh with
      * respect to surface area. Returns both position and normal
+     *
+     * The density of the samples is the inverse of \ref getSurfaceArea().
+     *
+     * \return The index of the triangle that contains the position
      */
-    void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const;
+    uint32_t samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const;
+
+    /**
+     * \brief Uniformly sample a position on the given triangle with
+     * respect to surface area. Returns both position and normal
+     */
+    void sampleTriangle(uint32_t index, const Point2f &sample, Point3f &p, Normal3f &n) const;
 
     /// Return the surface area of the given triangle
     float surfaceArea(uint32_t index) const;
 
+    /// Return the total surface area of the mesh
+    float getSurfaceArea() const { return m_dpdf.getSum(); }
+
     //// Return an axis-aligned bounding box of the entire mesh
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
@@ -134,16 +206,24 @@ public:
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MatrixXfMap &getVertexPositions() const { return m_V; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    /// Return a pointer to the vertex normals (or an empty matrix if there are none)
+    const MatrixXfMap &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    /// Return a pointer to the texture coordinates (or an empty matrix if there are none)
+    const MatrixXfMap &getVertexTexCoords() const { return m_UV; }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXuMap &getIndices() const { return m_F; }
+
+    /**
+     * \brief Write the mesh to a file in Nori's binary mesh format
+     *
+     * Such files can be loaded much faster than text-based formats,
+     * see the \c binary mesh plugin.
+     */
+    void writeBinary(const std::string &filename) const;
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -176,17 +256,45 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Make the mesh refer to the given vertex and index buffers
+     *
+     * The buffers are stored in column-major order (i.e. the coordinates of
+     * each vertex are contiguous) and used in place, hence they must remain
+     * valid for the lifetime of the mesh. \c N and \c UV may be \c nullptr.
+     */
+    void setBuffers(const float *V, const float *N, const float *UV,
+                    const uint32_t *F, uint32_t vertexCount, uint32_t triangleCount);
+
+    /**
+     * \brief Read the buffers of the mesh (called once by \ref load())
+     *
+     * Implementations call \ref setBuffers() and set \c m_bbox.
+     */
+    virtual void loadBuffers() = 0;
+
+    /**
+     * \brief Return an identifier of the given file that changes whenever
+     * the file is modified (its path, size and modification time)
+     */
+    static std::string getFileID(const std::string &filename);
+
+private:
+    /// Initialize the data structures that depend on the buffers
+    void finishLoading();
+
 protected:
 
-    DiscretePDF dpdf;
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    MatrixXfMap   m_V;                   ///< Vertex positions
+    MatrixXfMap   m_N;                   ///< Vertex normals
+    MatrixXfMap   m_UV;                  ///< Vertex texture coordinates
+    MatrixXuMap   m_F;                   ///< Faces
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
+    DiscretePDF   m_dpdf;                ///< Triangle areas, for \ref samplePosition()
+    bool          m_loaded = false;      ///< Have the buffers been loaded?
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,64 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only memory-mapped file
+ *
+ * Maps the entire contents of a file into the address space of the
+ * process, so that large binary files can be accessed without first
+ * reading them into a separate buffer. The operating system loads the
+ * pages lazily and shares them with its file cache.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the given file into memory. Throws a \ref NoriException on failure
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    /// Return a pointer to the file contents
+    const uint8_t *data() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+    /// Return the name of the mapped file
+    const std::string &getFilename() const { return m_filename; }
+
+private:
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    std::string m_filename;
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(PLATFORM_WINDOWS)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+NORI_NAMESPACE_END
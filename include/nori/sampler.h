@@ -74,8 +74,15 @@ public:
      * a new image block. This can be used to deterministically
      * initialize the sampler so that repeated program runs
      * always create the same image.
+     *
+     * \param block
+     *     The image block that is about to be rendered
+     * \param firstSample
+     *     Index of the first pixel sample that will be generated. Progressive
+     *     rendering visits each block several times, and every visit
+     *     must continue the sequence rather than repeat it.
      */
-    virtual void prepare(const ImageBlock &block) = 0;
+    virtual void prepare(const ImageBlock &block, size_t firstSample = 0) = 0;
 
     /**
      * \brief Prepare to generate new samples
@@ -88,12 +95,66 @@ public:
     /// Advance to the next sample
     virtual void advance() = 0;
 
+    /**
+     * \brief Jump to a specific sample and dimension of a pixel
+     *
+     * The renderer calls this function instead of \ref generate() and
+     * \ref advance() when it interleaves the samples of several pixels,
+     * e.g. when tracing an entire row of camera rays at once. Subsequent
+     * calls to \ref next1D() and \ref next2D() return the components of
+     * the requested sample starting at dimension \c dimension. Samplers
+     * that do not depend on the pixel and sample index (such as the
+     * independent sampler) can ignore this information.
+     *
+     * \param pixel
+     *     Integer coordinates of the pixel within the image
+     * \param index
+     *     Index of the sample, relative to the first sample
+     *     specified in \ref prepare()
+     * \param dimension
+     *     Index of the first component that will be requested
+     */
+    virtual void setSample(const Point2i &pixel, size_t index, uint32_t dimension = 0) { }
+
     /// Retrieve the next component value from the current sample
     virtual float next1D() = 0;
 
     /// Retrieve the next two component values from the current sample
     virtual Point2f next2D() = 0;
 
+    /**
+     * \brief Retrieve the next \c n component values from the current
+     * sample at once
+     *
+     * The default implementation requests pairs of components using
+     * \ref next2D() (and a trailing one using \ref next1D()).
+     */
+    virtual void nextND(float *out, size_t n) {
+        for (size_t i=0; i+1<n; i+=2) {
+            Point2f p = next2D();
+            out[i] = p.x();
+            out[i+1] = p.y();
+        }
+        if (n & 1)
+            out[n-1] = next1D();
+    }
+
+    /**
+     * \brief Generate the first \c dimension components of the same
+     * sample in several pixels at once
+     *
+     * This is equivalent to calling \ref setSample(pixels[k], index)
+     * followed by \ref nextND() for each pixel in turn. The components
+     * of pixel \c k are stored at <tt>out[k*dimension]</tt>.
+     */
+    virtual void nextBatch(const Point2i *pixels, size_t count, size_t index,
+                           uint32_t dimension, float *out) {
+        for (size_t k=0; k<count; ++k) {
+            setSample(pixels[k], index);
+            nextND(out + k * dimension, dimension);
+        }
+    }
+
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
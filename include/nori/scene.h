@@ -19,6 +19,8 @@
 #pragma once
 
 #include <nori/accel.h>
+#include <nori/bitmap.h>
+#include <nori/block.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -58,6 +60,60 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /// Return a reference to an array containing all emitters
+    const std::vector<Emitter *> &getEmitters() const { return m_emitters; }
+
+    /// Should the scene be rendered without opening a preview window?
+    bool isHeadless() const { return m_headless; }
+
+    /// Return the order in which image blocks are rendered
+    BlockGenerator::EOrder getBlockOrder() const { return m_blockOrder; }
+
+    /**
+     * \brief Return the relative error below which a pixel stops
+     * receiving samples (0 disables adaptive sampling)
+     */
+    float getAdaptiveThreshold() const { return m_adaptiveThreshold; }
+
+    /// Return the number of samples taken in every pixel before testing convergence
+    uint32_t getAdaptiveMinSamples() const { return m_adaptiveMinSamples; }
+
+    /**
+     * \brief Return the number of samples per pixel taken in each pass
+     * over the image (0: render all samples in a single pass)
+     */
+    uint32_t getPassSamples() const { return m_passSamples; }
+
+    /// Return the time (in seconds) after which a progressive render stops (0: unlimited)
+    float getTimeBudget() const { return m_timeBudget; }
+
+    /// Return the time (in seconds) between checkpoints of a progressive render (0: never)
+    float getCheckpointInterval() const { return m_checkpointInterval; }
+
+    /**
+     * \brief Should the output be streamed to a tiled OpenEXR file during
+     * rendering (instead of keeping the full image in memory)?
+     */
+    bool isTiledOutput() const { return m_tiledOutput; }
+
+    /// Return the compression method of the rendered OpenEXR files
+    Bitmap::ECompression getExrCompression() const { return m_exrCompression; }
+
+    /// Should the rendered OpenEXR files store half precision channels?
+    bool isExrHalf() const { return m_exrHalf; }
+
+    /// Return the maximum number of times per second the preview window is refreshed
+    float getPreviewRate() const { return m_previewRate; }
+
+    /// Should the preview window upload half precision pixels to the GPU?
+    bool isPreviewHalf() const { return m_previewHalf; }
+
+    /// Should image blocks be rendered by the \ref WavefrontRenderer?
+    bool isWavefront() const { return m_wavefront; }
+
+    /// Return the number of paths that each thread keeps in flight in wavefront mode
+    uint32_t getWavefrontQueueSize() const { return m_wavefrontQueueSize; }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -76,6 +132,52 @@ public:
         return m_accel->rayIntersect(ray, its, false);
     }
 
+    /**
+     * \brief Find the closest intersection of a ray with the triangles
+     * stored in the scene, without computing any details about it
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \param hit
+     *    A compact hit record, which can be passed to \ref
+     *    computeSurfaceInteraction() if more information is needed
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, HitRecord &hit) const {
+        return m_accel->rayIntersect(ray, hit);
+    }
+
+    /**
+     * \brief Find the closest intersections of a batch of rays with the
+     * triangles stored in the scene
+     *
+     * Coherent rays (e.g. the camera rays of a row of pixels) are traced
+     * jointly, which is considerably faster than separate queries.
+     *
+     * \param rays
+     *    An array of \c n rays
+     *
+     * \param hits
+     *    An array of \c n hit records. Records whose ray did not
+     *    intersect anything are invalid (see \ref HitRecord::isValid()).
+     *
+     * \return The number of rays that found an intersection
+     */
+    size_t rayIntersect(const Ray3f *rays, HitRecord *hits, size_t n) const {
+        return m_accel->rayIntersect(rays, hits, n);
+    }
+
+    /**
+     * \brief Compute detailed information (position, texture coordinates,
+     * and local frames) about a valid hit found by \ref rayIntersect()
+     */
+    void computeSurfaceInteraction(const HitRecord &hit, Intersection &its) const {
+        m_accel->computeIntersection(hit, its);
+    }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and \a only determine whether or not there is an intersection.
@@ -92,10 +194,39 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->occluded(ray);
     }
 
+    /**
+     * \brief Sample a position on one of the area emitters of the scene
+     *
+     * All emissive triangles of the scene are stored in one table, from
+     * which a triangle is chosen in constant time, with a probability
+     * proportional to its emitted power (surface area times the
+     * luminance of its radiance).
+     *
+     * \param lRec
+     *     A record whose \c ref field is set. On return, it describes
+     *     the sampled position and its density.
+     * \param selection
+     *     A uniformly distributed sample on \f$[0,1]\f$ that chooses the triangle
+     * \param sample
+     *     A uniformly distributed sample on \f$[0,1]^2\f$ that chooses the
+     *     position within the triangle
+     * \return
+     *     The emitted radiance divided by the density of the sample
+     *     (zero if sampling failed, or if there are no emitters).
+     *     Visibility is not taken into account.
+     */
+    Color3f sampleEmitter(EmitterQueryRecord &lRec, float selection, const Point2f &sample) const;
+
+    /**
+     * \brief Compute the density of \ref sampleEmitter() generating the
+     * position \c lRec.p on \c lRec.emitter, with respect to solid angles
+     * at \c lRec.ref
+     */
+    float pdfEmitter(const EmitterQueryRecord &lRec) const;
+
     /// \brief Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const {
         return m_accel->getBoundingBox();
@@ -118,10 +249,27 @@ public:
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Mesh *> m_meshes;
+    std::vector<Emitter *> m_emitters;
+    std::vector<std::pair<const Mesh *, uint32_t>> m_emitterTriangles;
+    DiscreteAliasPDF m_emitterPDF;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    bool m_headless = false;
+    BlockGenerator::EOrder m_blockOrder = BlockGenerator::ESpiral;
+    float m_adaptiveThreshold = 0.f;
+    uint32_t m_adaptiveMinSamples = 16;
+    uint32_t m_passSamples = 0;
+    float m_timeBudget = 0.f;
+    float m_checkpointInterval = 0.f;
+    bool m_tiledOutput = false;
+    Bitmap::ECompression m_exrCompression = Bitmap::EZipCompression;
+    bool m_exrHalf = false;
+    float m_previewRate = 20.f;
+    bool m_previewHalf = false;
+    bool m_wavefront = false;
+    uint32_t m_wavefrontQueueSize = 8192;
 };
 
 NORI_NAMESPACE_END
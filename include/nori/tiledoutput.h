@@ -0,0 +1,103 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <nori/bitmap.h>
+#include <nori/block.h>
+#include <memory>
+
+namespace Imf { class TiledOutputFile; }
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Writes a tiled OpenEXR file while the image is being rendered
+ *
+ * Instead of merging all rendered blocks into a full-resolution
+ * \ref ImageBlock, this class keeps separate accumulation buffers for the
+ * tiles of the output file, allocated on demand. Samples near the edge of
+ * a block also contribute to the surrounding tiles (up to the border size
+ * of the reconstruction filter). Once all pixels of a tile and of its
+ * neighbors have been rendered, the tile can no longer change: it is
+ * normalized, written to the file, and its buffer is released. Only the
+ * tiles along the front of the rendered region are kept in memory.
+ */
+class TiledImageOutput {
+public:
+    /**
+     * \brief Create the output file
+     *
+     * \param filename
+     *     Name of the OpenEXR file
+     * \param size
+     *     Size of the image
+     * \param filter
+     *     Reconstruction filter of the image blocks that will be merged
+     * \param compression
+     *     Compression method of the file
+     * \param halfFloat
+     *     Store 16 bit instead of 32 bit floating point channels
+     * \param tileSize
+     *     Size of the tiles in the output file
+     */
+    TiledImageOutput(const std::string &filename, const Vector2i &size,
+                     const ReconstructionFilter *filter,
+                     Bitmap::ECompression compression = Bitmap::EZipCompression,
+                     bool halfFloat = false, int tileSize = NORI_BLOCK_SIZE);
+
+    /// Release all memory and close the file
+    ~TiledImageOutput();
+
+    /**
+     * \brief Merge a rendered image block, and write all tiles
+     * that are complete as a result
+     *
+     * This function is thread-safe. Every pixel of the image must be
+     * covered by exactly one of the merged blocks.
+     */
+    void put(const ImageBlock &block);
+
+    /// Finish writing the file. Throws a \ref NoriException if tiles are missing
+    void close();
+
+private:
+    TiledImageOutput(const TiledImageOutput &) = delete;
+    TiledImageOutput &operator=(const TiledImageOutput &) = delete;
+
+    struct Tile;
+
+    /// Normalize and write the tile with the given index, then release it
+    void write(int index);
+
+    std::string m_filename;
+    Vector2i m_size;
+    Vector2i m_tileCount;
+    int m_borderSize;
+    int m_tileSize;
+    bool m_halfFloat;
+    std::unique_ptr<Tile[]> m_tiles;
+    std::unique_ptr<Imf::TiledOutputFile> m_file;
+    tbb::mutex m_fileMutex;
+    std::atomic<int> m_tilesWritten;
+    std::atomic<size_t> m_memory;
+    std::atomic<size_t> m_peakMemory;
+};
+
+NORI_NAMESPACE_END
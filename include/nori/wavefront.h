@@ -0,0 +1,148 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief State of a path traced by the \ref WavefrontRenderer
+ *
+ * Integrators that support wavefront rendering advance this state by
+ * one vertex at a time (see \ref Integrator::shade()).
+ */
+struct PathState {
+    /// Ray towards the next vertex of the path
+    Ray3f ray;
+    /// Next vertex of the path (found by the intersection stage)
+    HitRecord hit;
+    /// Importance weight of the camera ray
+    Color3f weight;
+    /// Product of the BSDF weights along the path
+    Color3f throughput;
+    /// Radiance gathered along the path so far
+    Color3f radiance;
+    /// Position of the camera ray on the image plane
+    Point2f pixelSample;
+    /// Pixel of the path, used to look up its sample
+    Point2i pixel;
+    /// Index of the pixel sample (see \ref Sampler::setSample())
+    uint32_t sampleIndex;
+    /// First sample dimension that the next vertex uses
+    uint32_t dimension;
+    /// Number of vertices that were shaded so far
+    uint32_t depth;
+    /// Density of the BSDF sample that generated \c ray (for MIS)
+    float bsdfPdf;
+    /// Was \c ray generated by a specular BSDF (or the camera)?
+    bool specular;
+    /// Should the path be continued along \c ray?
+    bool alive;
+
+    /// Create the state of a path that starts with the given camera ray
+    PathState(const Ray3f &ray = Ray3f(), const Color3f &weight = Color3f(1.0f))
+        : ray(ray), weight(weight), throughput(1.0f), radiance(0.0f),
+          pixelSample(0.0f, 0.0f), pixel(0, 0), sampleIndex(0), dimension(0),
+          depth(0), bsdfPdf(0.0f), specular(true), alive(true) { }
+};
+
+/**
+ * \brief Shadow ray of a \ref PathState, which adds \c contribution to
+ * the radiance of the path if nothing occludes it
+ */
+struct ShadowRay {
+    /// Segment from the shading point to the emitter
+    Ray3f ray;
+    /// Radiance that is added to the path when \c ray is unoccluded
+    Color3f contribution;
+    /// Path that receives the contribution
+    PathState *path;
+};
+
+/**
+ * \brief Renders image blocks by tracing many paths at once, in stages
+ *
+ * The default renderer computes one sample at a time, which makes every
+ * thread alternate between traversal, BSDF and emitter code. Instead, this
+ * renderer keeps a large queue of \ref PathState records and processes
+ * the entire queue by one stage before moving on to the next:
+ *
+ * 1. <b>Generate</b>: refill the queue with camera rays of the block
+ * 2. <b>Intersect</b>: trace the rays of all paths as one batch
+ * 3. <b>Sort</b>: group the paths by the mesh (and hence the BSDF) they hit
+ * 4. <b>Shade</b>: let the integrator process each group of paths, which
+ *    accounts for emission, queues shadow rays and samples the next ray
+ * 5. <b>Shadow-trace</b>: test the visibility of all shadow rays
+ * 6. <b>Accumulate</b>: add finished paths to the image block
+ *
+ * Each thread owns one instance, which is reused for all of its blocks.
+ */
+class WavefrontRenderer {
+public:
+    /**
+     * \brief Create a renderer for the given scene
+     *
+     * \param queueSize
+     *    Maximum number of paths in flight (must be at least
+     *    \ref NORI_BLOCK_SIZE)
+     */
+    WavefrontRenderer(const Scene *scene, size_t queueSize);
+
+    /**
+     * \brief Render \c sampleCount samples in each pixel of an image block
+     *
+     * \return The total number of samples taken
+     */
+    size_t render(Sampler *sampler, ImageBlock &block, uint32_t sampleCount);
+
+protected:
+    /// Add camera rays to the queue until it is full, returns their number
+    size_t generate(Sampler *sampler, const ImageBlock &block, uint32_t sampleCount);
+
+    /// Find the next vertex of all paths in the queue
+    void intersect();
+
+    /// Group the paths by the mesh they hit (paths that missed go last)
+    void sort();
+
+    /// Shade the next vertex of all paths that hit a mesh
+    void shade(Sampler *sampler);
+
+    /// Trace the queued shadow rays and add the contribution of unoccluded ones
+    void traceShadowRays();
+
+    /// Add finished paths to the image block and remove them from the queue
+    void accumulate(ImageBlock &block);
+
+private:
+    const Scene *m_scene;
+    size_t m_queueSize;
+    std::vector<PathState> m_paths;         ///< Paths in flight
+    std::vector<PathState> m_sorted;        ///< Paths in flight, grouped by mesh (during sorting)
+    std::vector<uint32_t> m_offsets;        ///< Index of the first path of every mesh (after sorting)
+    std::vector<ShadowRay> m_shadowRays;    ///< Shadow rays queued by the shading stage
+    std::vector<Ray3f> m_rays;              ///< Rays of the paths (during intersection)
+    std::vector<HitRecord> m_hits;          ///< Hits of the paths (during intersection)
+    int m_row;                              ///< Next row of the block to generate camera rays for
+    uint32_t m_sample;                      ///< Next sample index of that row
+};
+
+NORI_NAMESPACE_END
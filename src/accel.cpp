@@ -18,10 +18,15 @@
 
 #include <nori/accel.h>
 #include <nori/timer.h>
+#include <filesystem/path.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 /*
  * =======================================================================
  *   WARNING    WARNING    WARNING    WARNING    WARNING    WARNING
@@ -305,10 +310,600 @@ public:
     }
 };
 
+/// Spread the lower 10 bits of \c v so that there are two zero bits between each
+static inline uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/// Return the index of the most significant set bit of a nonzero value
+static inline int highestBit(uint32_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return (int) index;
+#else
+    return 31 - __builtin_clz(value);
+#endif
+}
+
+/**
+ * \brief Parallel LSD radix sort of 64-bit values by bits <tt>[firstBit, lastBit)</tt>
+ *
+ * Every pass processes 8 bits: the input is split into blocks whose
+ * digit histograms are computed and scattered in parallel, which
+ * keeps the sort stable.
+ */
+static void radixSort(std::vector<uint64_t> &data, int firstBit, int lastBit) {
+    const uint32_t BUCKETS = 256, BLOCK_SIZE = 1 << 16;
+    uint32_t n = (uint32_t) data.size(),
+             blockCount = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint64_t> temp(n);
+    std::vector<uint32_t> offsets(blockCount * BUCKETS);
+
+    for (int shift = firstBit; shift < lastBit; shift += 8) {
+        tbb::parallel_for(0u, blockCount, [&](uint32_t b) {
+            uint32_t *counts = &offsets[b * BUCKETS];
+            memset(counts, 0, sizeof(uint32_t) * BUCKETS);
+            for (uint32_t i = b * BLOCK_SIZE, end = std::min(n, i + BLOCK_SIZE); i < end; ++i)
+                counts[(data[i] >> shift) & (BUCKETS - 1)]++;
+        });
+
+        /* Turn the histograms into scatter offsets (bucket-major) */
+        uint32_t sum = 0;
+        for (uint32_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            for (uint32_t b = 0; b < blockCount; ++b) {
+                uint32_t count = offsets[b * BUCKETS + bucket];
+                offsets[b * BUCKETS + bucket] = sum;
+                sum += count;
+            }
+        }
+
+        tbb::parallel_for(0u, blockCount, [&](uint32_t b) {
+            uint32_t *offset = &offsets[b * BUCKETS];
+            for (uint32_t i = b * BLOCK_SIZE, end = std::min(n, i + BLOCK_SIZE); i < end; ++i)
+                temp[offset[(data[i] >> shift) & (BUCKETS - 1)]++] = data[i];
+        });
+
+        data.swap(temp);
+    }
+}
+
+/**
+ * \brief Linear BVH builder based on Morton codes
+ *
+ * Sorts the triangles along a Z-order curve through the centroid bounds
+ * using a parallel radix sort and emits the hierarchy by recursively
+ * splitting at the highest differing bit of the Morton codes, as described in
+ * "Fast BVH Construction on GPUs" by Lauterbach et al. (Eurographics 2009).
+ *
+ * Optionally, the triangles are first grouped into clusters that share the
+ * most significant bits of their Morton codes. An LBVH is built inside each
+ * cluster, and the clusters themselves are organized by a top-level binned
+ * SAH build (the HLBVH approach of Pantaleoni and Luebke, HPG 2010). This
+ * gives trees of much higher quality near the root at almost the same cost.
+ *
+ * The output uses the same node layout as \ref BVHBuildTask, i.e. the left
+ * child directly follows its parent and the right child of a node with
+ * \c n triangles on its left side is stored at offset <tt>2*n</tt>.
+ */
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Create a leaf when this many triangles are left
+        LEAF_SIZE = NORI_TRIANGLE_GROUP_SIZE,
+
+        /// Number of Morton code bits that identify an HLBVH cluster
+        CLUSTER_BITS = 12,
+
+        /// Build subtrees with fewer triangles serially
+        SERIAL_THRESHOLD = 4096
+    };
+
+    LBVHBuilder(Accel &bvh, bool refine) : bvh(bvh), refine(refine) { }
+
+    /// Build the tree into \c bvh.m_nodes and \c bvh.m_indices
+    void build() {
+        uint32_t size = (uint32_t) bvh.m_indices.size();
+
+        /* Compute the Morton codes of all triangle centroids */
+        BoundingBox3f centroidBounds;
+        for (uint32_t i = 0; i < size; ++i)
+            centroidBounds.expandBy(bvh.getCentroid(i));
+        Vector3f extents = centroidBounds.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? 1023.0f / extents[axis] : 0.0f;
+
+        keys.resize(size);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    /* The product can round up to 1024, which does not fit
+                       into the 10 bits per axis of the Morton code */
+                    Vector3f p = (bvh.getCentroid(i) - centroidBounds.min).cwiseProduct(scale)
+                        .cwiseMin(Vector3f::Constant(1023.0f));
+                    uint32_t code = (expandBits((uint32_t) p.x()) << 2) |
+                                    (expandBits((uint32_t) p.y()) << 1) |
+                                     expandBits((uint32_t) p.z());
+                    keys[i] = ((uint64_t) code << 32) | i;
+                }
+            }
+        );
+
+        /* Sort by Morton code (only 30 bits are used) */
+        radixSort(keys, 32, 62);
+        codes.resize(size);
+
+        /* Split the sorted sequence into clusters (a single one for plain LBVH) */
+        std::vector<Cluster> clusters;
+        for (uint32_t i = 0; i < size; ) {
+            uint32_t prefix = (uint32_t) (keys[i] >> (62 - CLUSTER_BITS)), j = i + 1;
+            if (refine) {
+                while (j < size && (uint32_t) (keys[j] >> (62 - CLUSTER_BITS)) == prefix)
+                    ++j;
+            } else {
+                j = size;
+            }
+            clusters.push_back(Cluster { i, j - i, BoundingBox3f() });
+            i = j;
+        }
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, clusters.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t c = range.begin(); c != range.end(); ++c) {
+                    Cluster &cluster = clusters[c];
+                    for (uint32_t i = cluster.start; i < cluster.start + cluster.size; ++i)
+                        cluster.bbox.expandBy(bvh.getBoundingBox((uint32_t) keys[i]));
+                }
+            }
+        );
+
+        buildClusters(0u, clusters.data(), clusters.data() + clusters.size(), 0u);
+    }
+
+private:
+    /// Group of triangles that are adjacent in Morton order
+    struct Cluster {
+        uint32_t start, size;
+        BoundingBox3f bbox;
+    };
+
+    /// Build a binned SAH tree over the clusters <tt>[begin, end)</tt>
+    BoundingBox3f buildClusters(uint32_t node_idx, Cluster *begin, Cluster *end, uint32_t offset) {
+        Accel::BVHNode &node = bvh.m_nodes[node_idx];
+
+        if (end - begin == 1) {
+            /* Move the triangles of the cluster into their final position */
+            for (uint32_t i = 0; i < begin->size; ++i) {
+                uint64_t key = keys[begin->start + i];
+                bvh.m_indices[offset + i] = (uint32_t) key;
+                codes[offset + i] = (uint32_t) (key >> 32);
+            }
+            return buildLBVH(node_idx, offset, offset + begin->size);
+        }
+
+        BoundingBox3f centroidBounds;
+        uint32_t size = 0;
+        for (Cluster *c = begin; c != end; ++c) {
+            centroidBounds.expandBy(c->bbox.getCenter());
+            size += c->size;
+        }
+
+        int axis = centroidBounds.getLargestAxis();
+        float min = centroidBounds.min[axis], max = centroidBounds.max[axis],
+              inv_bin_size = Bins::BIN_COUNT / (max-min);
+
+        Cluster *mid = nullptr;
+        if (max > min) {
+            Bins bins;
+            for (Cluster *c = begin; c != end; ++c) {
+                int index = std::min(Bins::BIN_COUNT - 1,
+                    (int) ((c->bbox.getCenter()[axis] - min) * inv_bin_size));
+                bins.counts[index] += c->size;
+                bins.bbox[index].expandBy(c->bbox);
+            }
+
+            /* Choose the split between bins with the lowest SAH cost */
+            BoundingBox3f bestLeft[Bins::BIN_COUNT];
+            bestLeft[0] = bins.bbox[0];
+            for (int i = 1; i < Bins::BIN_COUNT; ++i) {
+                bestLeft[i] = bestLeft[i - 1];
+                bestLeft[i].expandBy(bins.bbox[i]);
+            }
+
+            BoundingBox3f right;
+            uint32_t right_count = 0;
+            float best_cost = std::numeric_limits<float>::infinity();
+            int best_index = -1;
+            for (int i = Bins::BIN_COUNT - 1; i > 0; --i) {
+                right.expandBy(bins.bbox[i]);
+                right_count += bins.counts[i];
+                if (right_count == 0 || right_count == size)
+                    continue;
+                float cost = bestLeft[i - 1].getSurfaceArea() * (size - right_count) +
+                             right.getSurfaceArea() * right_count;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_index = i;
+                }
+            }
+
+            if (best_index != -1) {
+                mid = std::partition(begin, end, [&](const Cluster &c) {
+                    return std::min(Bins::BIN_COUNT - 1,
+                        (int) ((c.bbox.getCenter()[axis] - min) * inv_bin_size)) < best_index;
+                });
+            }
+        }
+
+        /* Fall back to a median split in Morton order */
+        if (mid == nullptr || mid == begin || mid == end)
+            mid = begin + (end - begin) / 2;
+
+        uint32_t left_count = 0;
+        for (Cluster *c = begin; c != mid; ++c)
+            left_count += c->size;
+
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis;
+        node.inner.flag = 0;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size < SERIAL_THRESHOLD) {
+            bbox_left = buildClusters(node_idx_left, begin, mid, offset);
+            bbox_right = buildClusters(node_idx_right, mid, end, offset + left_count);
+        } else {
+            tbb::parallel_invoke(
+                [&] { bbox_left = buildClusters(node_idx_left, begin, mid, offset); },
+                [&] { bbox_right = buildClusters(node_idx_right, mid, end, offset + left_count); }
+            );
+        }
+
+        node.bbox = bbox_left;
+        node.bbox.expandBy(bbox_right);
+        return node.bbox;
+    }
+
+    /// Build an LBVH over the Morton-sorted triangles <tt>[start, end)</tt> of \c bvh.m_indices
+    BoundingBox3f buildLBVH(uint32_t node_idx, uint32_t start, uint32_t end) {
+        Accel::BVHNode &node = bvh.m_nodes[node_idx];
+        uint32_t size = end - start;
+
+        if (size <= LEAF_SIZE) {
+            node.bbox.reset();
+            for (uint32_t i = start; i < end; ++i)
+                node.bbox.expandBy(bvh.getBoundingBox(bvh.m_indices[i]));
+            node.leaf.flag = 1;
+            node.leaf.start = start;
+            node.leaf.size = size;
+            return node.bbox;
+        }
+
+        /* Split where the highest differing bit of the Morton codes flips,
+           or in the middle if all codes are identical */
+        uint32_t first = codes[start], last = codes[end - 1], mid;
+        int axis = 0;
+        if (first == last) {
+            mid = start + size / 2;
+        } else {
+            int bit = highestBit(first ^ last);
+            uint32_t split = ((first >> bit) | 1u) << bit;
+            mid = (uint32_t) (std::lower_bound(codes.begin() + start,
+                codes.begin() + end, split) - codes.begin());
+            axis = 2 - bit % 3;
+        }
+
+        uint32_t left_count = mid - start;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis;
+        node.inner.flag = 0;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size < SERIAL_THRESHOLD) {
+            bbox_left = buildLBVH(node_idx_left, start, mid);
+            bbox_right = buildLBVH(node_idx_right, mid, end);
+        } else {
+            tbb::parallel_invoke(
+                [&] { bbox_left = buildLBVH(node_idx_left, start, mid); },
+                [&] { bbox_right = buildLBVH(node_idx_right, mid, end); }
+            );
+        }
+
+        node.bbox = bbox_left;
+        node.bbox.expandBy(bbox_right);
+        return node.bbox;
+    }
+
+private:
+    Accel &bvh;
+    bool refine;
+    std::vector<uint64_t> keys;   ///< Morton codes (upper half) and triangle indices (lower half)
+    std::vector<uint32_t> codes;  ///< Morton codes in the order of \c bvh.m_indices
+};
+
+/// Maximum number of rays that are traced together as a packet (one bit each in a mask)
+static const uint32_t PACKET_SIZE = 32;
+
+/// Minimum cosine between the rays of a packet and their mean direction
+static const float PACKET_COHERENCE = 0.9f;
+
+/// Return a mask with the lowest \c count bits set
+static inline uint32_t activeMask(uint32_t count) {
+    return count >= 32 ? 0xFFFFFFFFu : ((1u << count) - 1u);
+}
+
+/// Return the index of the least significant set bit of a nonzero mask
+static inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/**
+ * \brief Return the direction octant of a ray (bit \c i is set when the
+ * reciprocal direction is negative along axis \c i)
+ *
+ * Packets are grouped and traversed by this octant. It tests the sign bit,
+ * since a component of -0 has a reciprocal of -inf and must be treated as
+ * negative by the slab tests.
+ */
+static inline uint32_t directionOctant(const Ray3f &ray) {
+    return (std::signbit(ray.dRcp.x()) ? 1u : 0u) |
+           (std::signbit(ray.dRcp.y()) ? 2u : 0u) |
+           (std::signbit(ray.dRcp.z()) ? 4u : 0u);
+}
+
+void Accel::packTriangles() {
+    cout << "Packing triangle records .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Assign a contiguous range of triangle groups to every leaf */
+    const uint32_t K = NORI_TRIANGLE_GROUP_SIZE;
+    std::vector<uint32_t> leaves;
+    std::vector<uint32_t> groupOffset;
+    uint32_t groupCount = 0;
+    for (uint32_t i = 0; i < (uint32_t) m_nodes.size(); ++i) {
+        if (!m_nodes[i].isLeaf())
+            continue;
+        leaves.push_back(i);
+        groupOffset.push_back(groupCount);
+        groupCount += (m_nodes[i].leaf.size + K - 1) / K;
+    }
+
+    m_triangles.resize(groupCount);
+
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t) leaves.size()),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t l = range.begin(); l != range.end(); ++l) {
+                BVHNode &node = m_nodes[leaves[l]];
+                uint32_t start = node.start(), size = node.leaf.size;
+
+                for (uint32_t j = 0; j < size; j += K) {
+                    TriangleGroup &group = m_triangles[groupOffset[l] + j / K];
+                    for (uint32_t k = 0; k < K; ++k) {
+                        if (j + k >= size) {
+                            /* Degenerate padding triangle */
+                            for (int axis = 0; axis < 3; ++axis)
+                                group.p0[axis][k] = group.e1[axis][k] = group.e2[axis][k] = 0.0f;
+                            group.mesh[k] = group.prim[k] = (uint32_t) -1;
+                            continue;
+                        }
+
+                        uint32_t idx = m_indices[start + j + k];
+                        uint32_t meshIdx = findMesh(idx);
+                        const MatrixXfMap &V = m_meshes[meshIdx]->getVertexPositions();
+                        const MatrixXuMap &F = m_meshes[meshIdx]->getIndices();
+                        Point3f p0 = V.col(F(0, idx)), p1 = V.col(F(1, idx)), p2 = V.col(F(2, idx));
+                        Vector3f e1 = p1 - p0, e2 = p2 - p0;
+
+                        for (int axis = 0; axis < 3; ++axis) {
+                            group.p0[axis][k] = p0[axis];
+                            group.e1[axis][k] = e1[axis];
+                            group.e2[axis][k] = e2[axis];
+                        }
+                        group.mesh[k] = meshIdx;
+                        group.prim[k] = idx;
+                    }
+                }
+
+                node.leaf.start = groupOffset[l];
+                node.leaf.size = (size + K - 1) / K;
+            }
+        }
+    );
+
+    /* The triangle records supersede the index list */
+    m_indices.clear();
+    m_indices.shrink_to_fit();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(TriangleGroup) * m_triangles.size())
+        << ", " << m_triangles.size() << " groups of " << K << ")." << endl;
+}
+
+inline Accel::TriangleGroup::BoolK Accel::TriangleGroup::intersect(const Ray3f &ray,
+        FloatK &u, FloatK &v, FloatK &t) const {
+    /* Vectorized version of Mesh::rayIntersect() */
+    FloatK pvec[3] = {
+        ray.d.y() * e2[2] - ray.d.z() * e2[1],
+        ray.d.z() * e2[0] - ray.d.x() * e2[2],
+        ray.d.x() * e2[1] - ray.d.y() * e2[0]
+    };
+
+    FloatK det = e1[0] * pvec[0] + e1[1] * pvec[1] + e1[2] * pvec[2];
+    FloatK inv_det = det.inverse();
+
+    FloatK tvec[3] = {
+        ray.o.x() - p0[0], ray.o.y() - p0[1], ray.o.z() - p0[2]
+    };
+
+    u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * inv_det;
+
+    FloatK qvec[3] = {
+        tvec[1] * e1[2] - tvec[2] * e1[1],
+        tvec[2] * e1[0] - tvec[0] * e1[2],
+        tvec[0] * e1[1] - tvec[1] * e1[0]
+    };
+
+    v = (ray.d.x() * qvec[0] + ray.d.y() * qvec[1] + ray.d.z() * qvec[2]) * inv_det;
+    t = (e2[0] * qvec[0] + e2[1] * qvec[1] + e2[2] * qvec[2]) * inv_det;
+
+    return (det.abs() >= 1e-8f) && (u >= 0.0f) && (u <= 1.0f) &&
+           (v >= 0.0f) && (u + v <= 1.0f) &&
+           (t >= ray.mint) && (t <= ray.maxt);
+}
+
+bool Accel::intersectLeaf(Ray3f &ray, uint32_t start, uint32_t count,
+                          HitRecord &hit) const {
+    TriangleGroup::FloatK u, v, t;
+    bool foundIntersection = false;
+
+    for (uint32_t i = start, end = start + count; i < end; ++i) {
+        const TriangleGroup &g = m_triangles[i];
+        TriangleGroup::BoolK mask = g.intersect(ray, u, v, t);
+
+        if (!mask.any())
+            continue;
+
+        /* Find the closest of the lanes that registered a hit */
+        int k = -1;
+        for (int j = 0; j < NORI_TRIANGLE_GROUP_SIZE; ++j) {
+            if (mask[j] && (k < 0 || t[j] < t[k]))
+                k = j;
+        }
+
+        foundIntersection = true;
+        ray.maxt = hit.t = t[k];
+        hit.bary = Point2f(u[k], v[k]);
+        hit.mesh = g.mesh[k];
+        hit.prim = g.prim[k];
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::occludedLeaf(const Ray3f &ray, uint32_t start, uint32_t count) const {
+    TriangleGroup::FloatK u, v, t;
+
+    for (uint32_t i = start, end = start + count; i < end; ++i) {
+        if (m_triangles[i].intersect(ray, u, v, t).any())
+            return true;
+    }
+
+    return false;
+}
+
+void Accel::setBranchingFactor(int width) {
+    if (width != 2 && width != 4 && width != 8)
+        throw NoriException("Accel: unsupported BVH branching factor %i (must be 2, 4, or 8)!", width);
+    m_width = width;
+}
+
+template <> Accel::WideBVHNodeVector<4> &Accel::wideNodes<4>() { return m_nodes4; }
+template <> Accel::WideBVHNodeVector<8> &Accel::wideNodes<8>() { return m_nodes8; }
+
+template <int N> void Accel::collapse() {
+    cout << "Collapsing into a " << N << "-wide BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    WideBVHNodeVector<N> &nodes = wideNodes<N>();
+    nodes.clear();
+
+    /* Convert the binary subtree below 'node_idx' into a wide node (recursive) */
+    std::function<uint32_t(uint32_t)> convert = [&](uint32_t node_idx) -> uint32_t {
+        uint32_t children[N], count = 0;
+        if (m_nodes[node_idx].isLeaf()) {
+            children[count++] = node_idx;
+        } else {
+            children[count++] = node_idx + 1;
+            children[count++] = m_nodes[node_idx].inner.rightChild;
+        }
+
+        /* Greedily open up the inner child with the largest surface
+           area until there are N children or only leaves are left */
+        while (count < N) {
+            int best = -1;
+            float best_area = -1;
+            for (uint32_t i = 0; i < count; ++i) {
+                const BVHNode &c = m_nodes[children[i]];
+                if (c.isInner() && c.bbox.getSurfaceArea() > best_area) {
+                    best_area = c.bbox.getSurfaceArea();
+                    best = (int) i;
+                }
+            }
+            if (best == -1)
+                break;
+            uint32_t idx = children[best];
+            children[best] = idx + 1;
+            children[count++] = m_nodes[idx].inner.rightChild;
+        }
+
+        /* Store the children by decreasing surface area, which is the
+           order in which occlusion queries visit them */
+        std::sort(children, children + count, [&](uint32_t c1, uint32_t c2) {
+            return m_nodes[c1].bbox.getSurfaceArea() > m_nodes[c2].bbox.getSurfaceArea();
+        });
+
+        uint32_t result = (uint32_t) nodes.size();
+        nodes.emplace_back();
+        for (int axis = 0; axis < 3; ++axis) {
+            nodes[result].bounds[axis].setConstant(std::numeric_limits<float>::infinity());
+            nodes[result].bounds[axis + 3].setConstant(-std::numeric_limits<float>::infinity());
+        }
+        memset(nodes[result].child, 0, sizeof(uint32_t) * N);
+        memset(nodes[result].size, 0, sizeof(uint32_t) * N);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            const BVHNode &c = m_nodes[children[i]];
+            uint32_t child = c.isLeaf() ? c.start() : convert(children[i]);
+
+            /* Note: 'nodes' may have been reallocated by the recursion */
+            WideBVHNode<N> &node = nodes[result];
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = c.bbox.min[axis];
+                node.bounds[axis + 3][i] = c.bbox.max[axis];
+            }
+            node.child[i] = child;
+            node.size[i] = c.isLeaf() ? (uint32_t) c.leaf.size : 0u;
+        }
+        return result;
+    };
+
+    convert(0u);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(WideBVHNode<N>) * nodes.size())
+        << ", " << nodes.size() << " nodes)." << endl;
+}
+
 void Accel::addMesh(Mesh *mesh) {
     m_meshes.push_back(mesh);
-    m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
-    m_bbox.expandBy(mesh->getBoundingBox());
+}
+
+void Accel::updateMeshOffsets() {
+    m_meshOffset.clear();
+    m_meshOffset.push_back(0u);
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes) {
+        m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
+        m_bbox.expandBy(mesh->getBoundingBox());
+    }
 }
 
 void Accel::clear() {
@@ -318,19 +913,52 @@ void Accel::clear() {
     m_meshOffset.clear();
     m_meshOffset.push_back(0u);
     m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
     m_indices.clear();
+    m_primBounds.clear();
+    m_centroids.clear();
+    m_triangles.clear();
     m_bbox.reset();
     m_nodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
     m_meshes.shrink_to_fit();
     m_meshOffset.shrink_to_fit();
     m_indices.shrink_to_fit();
+    m_triangles.shrink_to_fit();
+    m_cacheFile.reset();
 }
 
 void Accel::build() {
+    if (m_meshes.empty())
+        return;
+
+    /* Look for a cached tree before loading any of the meshes: a hit
+       also provides their geometry, so that no file needs to be parsed */
+    std::string cacheFile;
+    uint64_t cacheKey = 0;
+    if (m_cachePolicy != ECacheOff && !m_cacheDirectory.empty())
+        cacheKey = this->cacheKey();
+    if (cacheKey != 0) {
+        cacheFile = (filesystem::path(m_cacheDirectory) /
+            filesystem::path(tfm::format("%016x.bvh", cacheKey))).str();
+        if (m_cachePolicy != ECacheRefresh && loadCache(cacheFile, cacheKey))
+            return;
+    }
+
+    for (Mesh *mesh : m_meshes)
+        mesh->load();
+    updateMeshOffsets();
+
     uint32_t size  = getTriangleCount();
     if (size == 0)
         return;
-    cout << "Constructing a SAH BVH (" << m_meshes.size()
+
+    const char *methodName =
+        m_buildMethod == ELBVHBuild ? "an LBVH" :
+        (m_buildMethod == EHLBVHBuild ? "an HLBVH" : "a SAH BVH");
+    cout << "Constructing " << methodName << " (" << m_meshes.size()
         << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
         << size << " triangles) .. ";
     cout.flush();
@@ -348,11 +976,39 @@ void Accel::build() {
     for (uint32_t i = 0; i < size; ++i)
         m_indices[i] = i;
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
+    /* Precompute the bounding box and centroid of every triangle once,
+       rather than looking them up in the meshes during construction */
+    m_primBounds.resize(size);
+    m_centroids.resize(size);
+    for (uint32_t meshIdx = 0; meshIdx < (uint32_t) m_meshes.size(); ++meshIdx) {
+        const Mesh *mesh = m_meshes[meshIdx];
+        uint32_t offset = m_meshOffset[meshIdx];
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, mesh->getTriangleCount(), BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_primBounds[offset + i] = mesh->getBoundingBox(i);
+                    m_centroids[offset + i] = mesh->getCentroid(i);
+                }
+            }
+        );
+    }
+
+    if (m_buildMethod == ESAHBuild) {
+        uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
+        BVHBuildTask& task = *new(tbb::task::allocate_root())
+            BVHBuildTask(*this, 0u, indices, indices + size , temp);
+        tbb::task::spawn_root_and_wait(task);
+        delete[] temp;
+    } else {
+        LBVHBuilder(*this, m_buildMethod == EHLBVHBuild).build();
+    }
+
+    m_primBounds.clear();
+    m_primBounds.shrink_to_fit();
+    m_centroids.clear();
+    m_centroids.shrink_to_fit();
+
     std::pair<float, uint32_t> stats = statistics();
 
     /* The node array was allocated conservatively and now contains
@@ -368,6 +1024,11 @@ void Accel::build() {
         skipped_accum[j] = (uint32_t) skipped;
 
         if (new_node.isInner()) {
+            /* Record which child is larger, so that occlusion queries
+               can visit it first without comparing the areas */
+            new_node.inner.largerRight =
+                m_nodes[new_node.inner.rightChild].bbox.getSurfaceArea() >
+                m_nodes[j + 1].bbox.getSurfaceArea();
             new_node.inner.rightChild = (uint32_t)
                 (i + new_node.inner.rightChild - j -
                 (skipped - skipped_accum[new_node.inner.rightChild]));
@@ -379,6 +1040,22 @@ void Accel::build() {
         << ")." << endl;
 
     m_nodes = std::move(compactified);
+
+    packTriangles();
+
+    if (m_width > 2) {
+        if (m_width == 4)
+            collapse<4>();
+        else
+            collapse<8>();
+
+        /* Traversal only uses the wide nodes from now on */
+        m_nodes.clear();
+        m_nodes.shrink_to_fit();
+    }
+
+    if (!cacheFile.empty() && m_cachePolicy != ECacheReadOnly)
+        saveCache(cacheFile, cacheKey);
 }
 
 std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
@@ -401,21 +1078,13 @@ std::pair<float, uint32_t> Accel::statistics(uint32_t node_idx) const {
     }
 }
 
-bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+bool Accel::traverseBinary(Ray3f &ray, HitRecord &hit) const {
     uint32_t node_idx = 0, stack_idx = 0, stack[64];
 
-    its.t = std::numeric_limits<float>::infinity();
-
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
-
-    if (m_nodes.empty() || ray.maxt < ray.mint)
+    if (m_nodes.empty())
         return false;
 
     bool foundIntersection = false;
-    uint32_t f = 0;
 
     while (true) {
         const BVHNode &node = m_nodes[node_idx];
@@ -432,75 +1101,509 @@ bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) c
             node_idx++;
             assert(stack_idx<64);
         } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Mesh *mesh = m_meshes[findMesh(idx)];
-
-                float u, v, t;
-                if (mesh->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = mesh;
-                    f = idx;
+            if (intersectLeaf(ray, node.start(), node.leaf.size, hit))
+                foundIntersection = true;
+            if (stack_idx == 0)
+                break;
+            node_idx = stack[--stack_idx];
+            continue;
+        }
+    }
+
+    return foundIntersection;
+}
+
+template <int N> bool Accel::traverseWide(Ray3f &ray, HitRecord &hit) const {
+    typedef typename WideBVHNode<N>::FloatN FloatN;
+    const WideBVHNodeVector<N> &nodes = wideNodes<N>();
+
+    if (nodes.empty())
+        return false;
+
+    /* Stack entries refer to a wide node (size == 0) or to a leaf,
+       along with the distance at which the ray enters its bounds */
+    struct StackEntry {
+        uint32_t child, size;
+        float t;
+    };
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0;
+
+    /* Broadcast the ray and select the near/far slab of each axis
+       based on the direction sign, which avoids min/max operations */
+    FloatN o[3], dRcp[3];
+    int nearIdx[3], farIdx[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        bool negative = ray.dRcp[axis] < 0;
+        o[axis].setConstant(ray.o[axis]);
+        dRcp[axis].setConstant(ray.dRcp[axis]);
+        nearIdx[axis] = negative ? axis + 3 : axis;
+        farIdx[axis]  = negative ? axis : axis + 3;
+    }
+
+    bool foundIntersection = false;
+    stack[stack_idx++] = StackEntry { 0u, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        /* Skip subtrees that lie behind the closest intersection so far */
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.size == 0) {
+            const WideBVHNode<N> &node = nodes[entry.child];
+
+            /* Intersect the ray against all N child boxes at once */
+            FloatN tNear = ((node.bounds[nearIdx[0]] - o[0]) * dRcp[0])
+                .max((node.bounds[nearIdx[1]] - o[1]) * dRcp[1])
+                .max((node.bounds[nearIdx[2]] - o[2]) * dRcp[2])
+                .max(FloatN::Constant(ray.mint));
+            FloatN tFar = ((node.bounds[farIdx[0]] - o[0]) * dRcp[0])
+                .min((node.bounds[farIdx[1]] - o[1]) * dRcp[1])
+                .min((node.bounds[farIdx[2]] - o[2]) * dRcp[2])
+                .min(FloatN::Constant(ray.maxt));
+            Eigen::Array<bool, N, 1> hit = tNear <= tFar;
+
+            /* Sort the children that were hit by decreasing distance
+               and push them, so that the nearest one is popped first */
+            int order[N], hitCount = 0;
+            for (int i = 0; i < N; ++i) {
+                if (!hit[i])
+                    continue;
+                int j = hitCount++;
+                while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+                    order[j] = order[j - 1];
+                    --j;
                 }
+                order[j] = i;
             }
+
+            for (int k = 0; k < hitCount; ++k) {
+                int i = order[k];
+                stack[stack_idx++] = StackEntry { node.child[i], node.size[i], tNear[i] };
+            }
+            assert(stack_idx <= 64 * N);
+        } else if (intersectLeaf(ray, entry.child, entry.size, hit)) {
+            foundIntersection = true;
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Accel::occludedBinary(const Ray3f &ray) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+
+    if (m_nodes.empty())
+        return false;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+
+        if (!node.bbox.rayIntersect(ray)) {
             if (stack_idx == 0)
                 break;
             node_idx = stack[--stack_idx];
             continue;
         }
+
+        if (node.isInner()) {
+            /* Any hit terminates the query, so visit the child that
+               is more likely to be hit (the larger one) first */
+            uint32_t left = node_idx + 1, right = node.inner.rightChild;
+            if (node.inner.largerRight)
+                std::swap(left, right);
+            stack[stack_idx++] = right;
+            node_idx = left;
+            assert(stack_idx<64);
+        } else {
+            if (occludedLeaf(ray, node.start(), node.leaf.size))
+                return true;
+            if (stack_idx == 0)
+                break;
+            node_idx = stack[--stack_idx];
+            continue;
+        }
+    }
+
+    return false;
+}
+
+template <int N> bool Accel::occludedWide(const Ray3f &ray) const {
+    typedef typename WideBVHNode<N>::FloatN FloatN;
+    const WideBVHNodeVector<N> &nodes = wideNodes<N>();
+
+    if (nodes.empty())
+        return false;
+
+    struct StackEntry {
+        uint32_t child, size;
+    };
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0;
+
+    FloatN o[3], dRcp[3];
+    int nearIdx[3], farIdx[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        bool negative = ray.dRcp[axis] < 0;
+        o[axis].setConstant(ray.o[axis]);
+        dRcp[axis].setConstant(ray.dRcp[axis]);
+        nearIdx[axis] = negative ? axis + 3 : axis;
+        farIdx[axis]  = negative ? axis : axis + 3;
+    }
+
+    stack[stack_idx++] = StackEntry { 0u, 0u };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        if (entry.size != 0) {
+            if (occludedLeaf(ray, entry.child, entry.size))
+                return true;
+            continue;
+        }
+
+        const WideBVHNode<N> &node = nodes[entry.child];
+
+        FloatN tNear = ((node.bounds[nearIdx[0]] - o[0]) * dRcp[0])
+            .max((node.bounds[nearIdx[1]] - o[1]) * dRcp[1])
+            .max((node.bounds[nearIdx[2]] - o[2]) * dRcp[2])
+            .max(FloatN::Constant(ray.mint));
+        FloatN tFar = ((node.bounds[farIdx[0]] - o[0]) * dRcp[0])
+            .min((node.bounds[farIdx[1]] - o[1]) * dRcp[1])
+            .min((node.bounds[farIdx[2]] - o[2]) * dRcp[2])
+            .min(FloatN::Constant(ray.maxt));
+        Eigen::Array<bool, N, 1> hit = tNear <= tFar;
+
+        /* The children are stored by decreasing surface area. Push them
+           in reverse so that the largest one is visited first; distances
+           don't matter, since any hit terminates the query */
+        for (int i = N - 1; i >= 0; --i) {
+            if (hit[i])
+                stack[stack_idx++] = StackEntry { node.child[i], node.size[i] };
+        }
+        assert(stack_idx <= 64 * N);
+    }
+
+    return false;
+}
+
+uint32_t Accel::traversePacketBinary(Ray3f *rays, HitRecord **hits, uint32_t count) const {
+    struct StackEntry {
+        uint32_t node_idx, mask;
+    };
+    StackEntry stack[64];
+    uint32_t stack_idx = 0, found = 0;
+
+    if (m_nodes.empty())
+        return 0;
+
+    /* All rays of the packet share the same direction octant, which
+       determines the child that lies closer along each split axis */
+    uint32_t octant = directionOctant(rays[0]);
+    bool negative[3];
+    for (int axis = 0; axis < 3; ++axis)
+        negative[axis] = (octant >> axis) & 1;
+
+    stack[stack_idx++] = StackEntry { 0u, activeMask(count) };
+
+    while (stack_idx > 0) {
+        StackEntry entry = stack[--stack_idx];
+
+        while (true) {
+            const BVHNode &node = m_nodes[entry.node_idx];
+
+            /* Determine the subset of rays that still overlap this node */
+            uint32_t mask = 0;
+            for (uint32_t m = entry.mask; m != 0; m &= m - 1) {
+                int r = lowestBit(m);
+                if (node.bbox.rayIntersect(rays[r]))
+                    mask |= 1u << r;
+            }
+
+            if (mask == 0)
+                break;
+
+            if (node.isInner()) {
+                /* Visit the near child first and defer the far one */
+                uint32_t near = entry.node_idx + 1, far = node.inner.rightChild;
+                if (negative[node.inner.axis])
+                    std::swap(near, far);
+                stack[stack_idx++] = StackEntry { far, mask };
+                assert(stack_idx < 64);
+                entry = StackEntry { near, mask };
+            } else {
+                for (uint32_t m = mask; m != 0; m &= m - 1) {
+                    int r = lowestBit(m);
+                    if (intersectLeaf(rays[r], node.start(), node.leaf.size, *hits[r]))
+                        found |= 1u << r;
+                }
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+template <int N> uint32_t Accel::traversePacketWide(Ray3f *rays, HitRecord **hits, uint32_t count) const {
+    typedef typename WideBVHNode<N>::FloatN FloatN;
+    const WideBVHNodeVector<N> &nodes = wideNodes<N>();
+
+    if (nodes.empty())
+        return 0;
+
+    /* Stack entries refer to a wide node (size == 0) or to a leaf,
+       along with the mask of rays that need to visit it */
+    struct StackEntry {
+        uint32_t child, size, mask;
+    };
+    StackEntry stack[64 * N];
+    uint32_t stack_idx = 0, found = 0;
+
+    /* All rays of the packet share the same direction octant */
+    uint32_t octant = directionOctant(rays[0]);
+    int nearIdx[3], farIdx[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        bool negative = (octant >> axis) & 1;
+        nearIdx[axis] = negative ? axis + 3 : axis;
+        farIdx[axis]  = negative ? axis : axis + 3;
+    }
+
+    stack[stack_idx++] = StackEntry { 0u, 0u, activeMask(count) };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        if (entry.size == 0) {
+            const WideBVHNode<N> &node = nodes[entry.child];
+
+            /* Slab test of every active ray against all N child boxes,
+               recording which rays hit each child and how early */
+            uint32_t childMask[N];
+            memset(childMask, 0, sizeof(uint32_t) * N);
+            FloatN minNear = FloatN::Constant(std::numeric_limits<float>::infinity());
+
+            for (uint32_t m = entry.mask; m != 0; m &= m - 1) {
+                int r = lowestBit(m);
+                const Ray3f &ray = rays[r];
+
+                FloatN tNear = ((node.bounds[nearIdx[0]] - ray.o[0]) * ray.dRcp[0])
+                    .max((node.bounds[nearIdx[1]] - ray.o[1]) * ray.dRcp[1])
+                    .max((node.bounds[nearIdx[2]] - ray.o[2]) * ray.dRcp[2])
+                    .max(FloatN::Constant(ray.mint));
+                FloatN tFar = ((node.bounds[farIdx[0]] - ray.o[0]) * ray.dRcp[0])
+                    .min((node.bounds[farIdx[1]] - ray.o[1]) * ray.dRcp[1])
+                    .min((node.bounds[farIdx[2]] - ray.o[2]) * ray.dRcp[2])
+                    .min(FloatN::Constant(ray.maxt));
+                Eigen::Array<bool, N, 1> hit = tNear <= tFar;
+
+                for (int i = 0; i < N; ++i) {
+                    if (hit[i])
+                        childMask[i] |= 1u << r;
+                }
+                minNear = hit.select(minNear.min(tNear), minNear);
+            }
+
+            /* Push the children that were hit by decreasing distance */
+            int order[N], hitCount = 0;
+            for (int i = 0; i < N; ++i) {
+                if (childMask[i] == 0)
+                    continue;
+                int j = hitCount++;
+                while (j > 0 && minNear[order[j - 1]] < minNear[i]) {
+                    order[j] = order[j - 1];
+                    --j;
+                }
+                order[j] = i;
+            }
+
+            for (int k = 0; k < hitCount; ++k) {
+                int i = order[k];
+                stack[stack_idx++] = StackEntry { node.child[i], node.size[i], childMask[i] };
+            }
+            assert(stack_idx <= 64 * N);
+        } else {
+            for (uint32_t m = entry.mask; m != 0; m &= m - 1) {
+                int r = lowestBit(m);
+                if (intersectLeaf(rays[r], entry.child, entry.size, *hits[r]))
+                    found |= 1u << r;
+            }
+        }
+    }
+
+    return found;
+}
+
+/// Apply the adaptive ray epsilon used by all intersection queries
+static inline Ray3f adaptRay(const Ray3f &_ray) {
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+    return ray;
+}
+
+bool Accel::traverse(Ray3f &ray, HitRecord &hit) const {
+    switch (m_width) {
+        case 4:  return traverseWide<4>(ray, hit);
+        case 8:  return traverseWide<8>(ray, hit);
+        default: return traverseBinary(ray, hit);
+    }
+}
+
+void Accel::computeIntersection(const HitRecord &hit, Intersection &its) const {
+    uint32_t f = hit.prim;
+    its.t = hit.t;
+    its.mesh = m_meshes[hit.mesh];
+    its.idx = f;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-hit.bary.sum(), hit.bary;
+
+    /* References to all relevant mesh buffers */
+    const Mesh *mesh   = its.mesh;
+    const MatrixXfMap &V  = mesh->getVertexPositions();
+    const MatrixXfMap &N  = mesh->getVertexNormals();
+    const MatrixXfMap &UV = mesh->getVertexTexCoords();
+    const MatrixXuMap &F  = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) +
+            bary.y() * UV.col(idx1) +
+            bary.z() * UV.col(idx2);
+    else
+        its.uv = hit.bary;
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * N.col(idx0) +
+             bary.y() * N.col(idx1) +
+             bary.z() * N.col(idx2)).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
+}
+
+bool Accel::occluded(const Ray3f &_ray) const {
+    /* Use an adaptive ray epsilon */
+    Ray3f ray = adaptRay(_ray);
+
+    if (ray.maxt < ray.mint)
+        return false;
+
+    switch (m_width) {
+        case 4:  return occludedWide<4>(ray);
+        case 8:  return occludedWide<8>(ray);
+        default: return occludedBinary(ray);
     }
+}
+
+bool Accel::rayIntersect(const Ray3f &_ray, HitRecord &hit) const {
+    hit = HitRecord();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray = adaptRay(_ray);
 
-    if (foundIntersection) {
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0),
-                bary.y() * UV.col(idx1),
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
+    if (ray.maxt < ray.mint)
+        return false;
+
+    return traverse(ray, hit);
+}
+
+bool Accel::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+    if (shadowRay)
+        return occluded(ray);
+
+    HitRecord hit;
+    if (!rayIntersect(ray, hit))
+        return false;
+
+    computeIntersection(hit, its);
+    return true;
+}
+
+size_t Accel::rayIntersect(const Ray3f *rays, HitRecord *hits, size_t n) const {
+    /* Sort the rays by direction octant and a coarsely quantized
+       direction so that neighboring entries form coherent packets */
+    std::vector<std::pair<uint32_t, uint32_t>> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        const Vector3f &d = rays[i].d;
+        Vector3f da = d.cwiseAbs() / d.norm();
+        uint32_t octant = directionOctant(rays[i]);
+        uint32_t qx = (uint32_t) std::min(31, (int) (da.x() * 32)),
+                 qy = (uint32_t) std::min(31, (int) (da.y() * 32));
+        order[i] = std::make_pair((octant << 10) | (qx << 5) | qy, (uint32_t) i);
+    }
+    std::sort(order.begin(), order.end());
+
+    Ray3f packet[PACKET_SIZE];
+    HitRecord *packetHits[PACKET_SIZE];
+    size_t hitCount = 0;
+
+    for (size_t start = 0; start < n; ) {
+        /* Gather up to PACKET_SIZE consecutive rays from the same octant */
+        uint32_t octant = order[start].first >> 10, count = 0;
+        Vector3f meanDir = Vector3f::Zero();
+        while (start + count < n && count < PACKET_SIZE &&
+               (order[start + count].first >> 10) == octant) {
+            uint32_t idx = order[start + count].second;
+            packet[count] = adaptRay(rays[idx]);
+            packetHits[count] = &hits[idx];
+            hits[idx] = HitRecord();
+            meanDir += packet[count].d.normalized();
+            ++count;
+        }
+
+        /* Only trace the packet jointly when its directions are similar,
+           otherwise the shared traversal visits too many nodes */
+        bool coherent = count > 1;
+        meanDir.normalize();
+        for (uint32_t k = 0; k < count && coherent; ++k)
+            coherent = packet[k].d.normalized().dot(meanDir) >= PACKET_COHERENCE;
+
+        uint32_t found = 0;
+        if (coherent) {
+            switch (m_width) {
+                case 4:  found = traversePacketWide<4>(packet, packetHits, count); break;
+                case 8:  found = traversePacketWide<8>(packet, packetHits, count); break;
+                default: found = traversePacketBinary(packet, packetHits, count); break;
+            }
         } else {
-            its.shFrame = its.geoFrame;
+            for (uint32_t k = 0; k < count; ++k) {
+                if (packet[k].maxt >= packet[k].mint &&
+                    traverse(packet[k], *packetHits[k]))
+                    found |= 1u << k;
+            }
         }
+
+        for (uint32_t m = found; m != 0; m &= m - 1)
+            ++hitCount;
+
+        start += count;
     }
 
-    return foundIntersection;
+    return hitCount;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,406 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <nori/accel.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <fstream>
+#include <cstdio>
+#include <limits>
+
+#if defined(PLATFORM_WINDOWS)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Increment whenever the layout of the cached data structures changes
+static const uint32_t CACHE_VERSION = 3;
+
+/// Alignment of the arrays within a cache file
+static const uint64_t CACHE_ALIGNMENT = 64;
+
+/**
+ * \brief Header of a BVH cache file
+ *
+ * It is followed by the node and triangle group arrays, one
+ * \ref CacheMesh record per mesh, and the buffers of the meshes
+ */
+struct CacheHeader {
+    char     magic[8];          ///< Identifier ("NORIBVH")
+    uint32_t version;           ///< Format version (\ref CACHE_VERSION)
+    uint32_t width;             ///< Branching factor of the stored nodes
+    uint64_t key;               ///< Hash of the mesh sources and build parameters
+    uint64_t nodeOffset;        ///< Byte offset of the node array
+    uint64_t nodeCount;         ///< Number of binary or wide nodes
+    uint64_t triangleOffset;    ///< Byte offset of the triangle group array
+    uint64_t triangleCount;     ///< Number of triangle groups
+    uint64_t meshOffset;        ///< Byte offset of the mesh records
+    uint64_t meshCount;         ///< Number of mesh records
+};
+
+/// Location of the (transformed) buffers of one mesh within a cache file
+struct CacheMesh {
+    uint32_t vertexCount;       ///< Number of vertices
+    uint32_t triangleCount;     ///< Number of triangles
+    float    bbox[6];           ///< Bounding box (min, max)
+    uint64_t positionOffset;    ///< Byte offset of the vertex positions
+    uint64_t normalOffset;      ///< Byte offset of the vertex normals (or 0)
+    uint64_t texcoordOffset;    ///< Byte offset of the texture coordinates (or 0)
+    uint64_t indexOffset;       ///< Byte offset of the triangle indices
+};
+
+/// Hash a buffer eight bytes at a time (using the MurmurHash3 mixing functions)
+static uint64_t hashBuffer(const void *data, size_t size, uint64_t hash) {
+    auto mix = [](uint64_t h, uint64_t k) {
+        k *= 0x87c37b91114253d5ULL;
+        k = (k << 31) | (k >> 33);
+        k *= 0x4cf5ad432745937fULL;
+        h ^= k;
+        h = (h << 27) | (h >> 37);
+        return h * 5 + 0x52dce729;
+    };
+
+    const uint8_t *ptr = (const uint8_t *) data;
+    for (; size >= 8; ptr += 8, size -= 8) {
+        uint64_t k;
+        memcpy(&k, ptr, 8);
+        hash = mix(hash, k);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, ptr, size);
+    hash = mix(hash, tail ^ ((uint64_t) size << 56));
+
+    /* Final avalanche */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/// Round up to the next multiple of \ref CACHE_ALIGNMENT
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+}
+
+uint64_t Accel::cacheKey() const {
+    uint64_t params[] = {
+        CACHE_VERSION, (uint64_t) m_width, (uint64_t) m_buildMethod,
+        NORI_TRIANGLE_GROUP_SIZE, sizeof(BVHNode), sizeof(TriangleGroup)
+    };
+    uint64_t hash = hashBuffer(params, sizeof(params), 0);
+
+    /* Only the identity of the mesh files enters the key, so that the
+       lookup does not require parsing them */
+    for (const Mesh *mesh : m_meshes) {
+        std::string id = mesh->getSourceID();
+        if (id.empty())
+            return 0;
+        hash = hashBuffer(id.c_str(), id.length() + 1, hash);
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+bool Accel::loadCache(const std::string &filename, uint64_t key) {
+    if (!filesystem::path(filename).exists())
+        return false;
+
+    cout << "Loading cached BVH \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    size_t nodeSize = m_width == 4 ? sizeof(WideBVHNode<4>) :
+        (m_width == 8 ? sizeof(WideBVHNode<8>) : sizeof(BVHNode));
+
+    try {
+        std::unique_ptr<MemoryMappedFile> file(new MemoryMappedFile(filename));
+        const uint8_t *data = file->data();
+        uint64_t size = file->size();
+
+        CacheHeader header;
+        if (size < sizeof(CacheHeader))
+            throw NoriException("truncated header");
+        memcpy(&header, data, sizeof(CacheHeader));
+
+        if (memcmp(header.magic, "NORIBVH", 8) != 0 ||
+            header.version != CACHE_VERSION || header.key != key ||
+            header.width != (uint32_t) m_width ||
+            header.meshCount != m_meshes.size())
+            throw NoriException("incompatible file");
+
+        auto check = [&](uint64_t offset, uint64_t count, uint64_t elementSize) {
+            if (offset % CACHE_ALIGNMENT != 0 || offset > size ||
+                count > (size - offset) / elementSize)
+                throw NoriException("truncated file");
+        };
+        if (header.nodeCount == 0)
+            throw NoriException("truncated file");
+        check(header.nodeOffset, header.nodeCount, nodeSize);
+        check(header.triangleOffset, header.triangleCount, sizeof(TriangleGroup));
+        check(header.meshOffset, header.meshCount, sizeof(CacheMesh));
+
+        /* Validate all mesh records before any mesh is restored */
+        std::vector<CacheMesh> meshes(header.meshCount);
+        memcpy(meshes.data(), data + header.meshOffset, sizeof(CacheMesh) * header.meshCount);
+        uint64_t triangleCount = 0;
+        for (const CacheMesh &mesh : meshes) {
+            check(mesh.positionOffset, 3 * (uint64_t) mesh.vertexCount, sizeof(float));
+            if (mesh.normalOffset)
+                check(mesh.normalOffset, 3 * (uint64_t) mesh.vertexCount, sizeof(float));
+            if (mesh.texcoordOffset)
+                check(mesh.texcoordOffset, 2 * (uint64_t) mesh.vertexCount, sizeof(float));
+            check(mesh.indexOffset, 3 * (uint64_t) mesh.triangleCount, sizeof(uint32_t));
+            triangleCount += mesh.triangleCount;
+
+            /* The faces are used as is, make sure that they refer to existing vertices */
+            const uint32_t *indices = (const uint32_t *) (data + mesh.indexOffset);
+            for (uint64_t j = 0; j < 3 * (uint64_t) mesh.triangleCount; ++j) {
+                if (indices[j] >= mesh.vertexCount)
+                    throw NoriException("invalid vertex index");
+            }
+        }
+        if (triangleCount > std::numeric_limits<uint32_t>::max())
+            throw NoriException("incompatible file");
+
+        /* The tree is small compared to the geometry, copy it */
+        const uint8_t *nodes = data + header.nodeOffset;
+        switch (m_width) {
+            case 4:
+                m_nodes4.resize(header.nodeCount);
+                memcpy((void *) m_nodes4.data(), nodes, nodeSize * header.nodeCount);
+                break;
+            case 8:
+                m_nodes8.resize(header.nodeCount);
+                memcpy((void *) m_nodes8.data(), nodes, nodeSize * header.nodeCount);
+                break;
+            default:
+                m_nodes.resize(header.nodeCount);
+                memcpy((void *) m_nodes.data(), nodes, nodeSize * header.nodeCount);
+                break;
+        }
+
+        m_triangles.resize(header.triangleCount);
+        memcpy((void *) m_triangles.data(), data + header.triangleOffset,
+            sizeof(TriangleGroup) * header.triangleCount);
+
+        /* Traversal does not check any indices, so validate them here. The
+           children of a node are always stored after it, which also rules
+           out cycles in the tree. */
+        uint64_t nodeCount = header.nodeCount, groupCount = header.triangleCount;
+        auto checkChild = [&](uint64_t parent, uint64_t child) {
+            if (child <= parent || child >= nodeCount)
+                throw NoriException("invalid node index");
+        };
+        auto checkLeaf = [&](uint64_t start, uint64_t count) {
+            if (start > groupCount || count > groupCount - start)
+                throw NoriException("invalid triangle group index");
+        };
+        auto checkWide = [&](const auto &nodes, int width) {
+            for (uint64_t i = 0; i < nodeCount; ++i) {
+                const auto &node = nodes[i];
+                for (int j = 0; j < width; ++j) {
+                    /* Unused slots have an empty box and are never visited */
+                    bool unused = node.size[j] == 0 && node.child[j] == 0 &&
+                                  !(node.bounds[0][j] <= node.bounds[3][j]);
+                    if (node.size[j] > 0)
+                        checkLeaf(node.child[j], node.size[j]);
+                    else if (!unused)
+                        checkChild(i, node.child[j]);
+                }
+            }
+        };
+        switch (m_width) {
+            case 4: checkWide(m_nodes4, 4); break;
+            case 8: checkWide(m_nodes8, 8); break;
+            default:
+                for (uint64_t i = 0; i < nodeCount; ++i) {
+                    const BVHNode &node = m_nodes[i];
+                    if (node.isLeaf()) {
+                        checkLeaf(node.start(), node.leaf.size);
+                    } else {
+                        if (node.inner.axis > 2)
+                            throw NoriException("invalid split axis");
+                        checkChild(i, i + 1);
+                        checkChild(i, node.inner.rightChild);
+                    }
+                }
+                break;
+        }
+
+        /* Padding slots must hold a degenerate triangle, all others a valid triangle */
+        for (const TriangleGroup &group : m_triangles) {
+            for (int k = 0; k < NORI_TRIANGLE_GROUP_SIZE; ++k) {
+                uint32_t meshIdx = group.mesh[k], prim = group.prim[k];
+                if (meshIdx == (uint32_t) -1 && prim == (uint32_t) -1) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        if (group.e1[axis][k] != 0.0f || group.e2[axis][k] != 0.0f)
+                            throw NoriException("invalid triangle group");
+                    }
+                } else if (meshIdx >= meshes.size() || prim >= meshes[meshIdx].triangleCount) {
+                    throw NoriException("invalid triangle group");
+                }
+            }
+        }
+
+        /* .. while the meshes use their buffers within the mapping */
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            const CacheMesh &mesh = meshes[i];
+            m_meshes[i]->restore(
+                (const float *) (data + mesh.positionOffset),
+                mesh.normalOffset ? (const float *) (data + mesh.normalOffset) : nullptr,
+                mesh.texcoordOffset ? (const float *) (data + mesh.texcoordOffset) : nullptr,
+                (const uint32_t *) (data + mesh.indexOffset),
+                mesh.vertexCount, mesh.triangleCount,
+                BoundingBox3f(Point3f(mesh.bbox[0], mesh.bbox[1], mesh.bbox[2]),
+                              Point3f(mesh.bbox[3], mesh.bbox[4], mesh.bbox[5])));
+        }
+        updateMeshOffsets();
+        m_cacheFile = std::move(file);
+
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(size) << " mapped)." << endl;
+        return true;
+    } catch (const NoriException &e) {
+        cout << "failed (" << e.what() << "), rebuilding." << endl;
+        m_nodes.clear();
+        m_nodes4.clear();
+        m_nodes8.clear();
+        m_triangles.clear();
+        return false;
+    }
+}
+
+void Accel::saveCache(const std::string &filename, uint64_t key) const {
+    cout << "Writing BVH cache \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Create the cache directory if necessary */
+    if (!filesystem::path(m_cacheDirectory).exists()) {
+#if defined(PLATFORM_WINDOWS)
+        _mkdir(m_cacheDirectory.c_str());
+#else
+        mkdir(m_cacheDirectory.c_str(), 0755);
+#endif
+    }
+
+    const void *nodes;
+    size_t nodeSize, nodeCount;
+    switch (m_width) {
+        case 4:  nodes = m_nodes4.data(); nodeSize = sizeof(WideBVHNode<4>); nodeCount = m_nodes4.size(); break;
+        case 8:  nodes = m_nodes8.data(); nodeSize = sizeof(WideBVHNode<8>); nodeCount = m_nodes8.size(); break;
+        default: nodes = m_nodes.data();  nodeSize = sizeof(BVHNode);        nodeCount = m_nodes.size();  break;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, "NORIBVH", 8);
+    header.version = CACHE_VERSION;
+    header.width = (uint32_t) m_width;
+    header.key = key;
+    header.nodeOffset = alignOffset(sizeof(CacheHeader));
+    header.nodeCount = nodeCount;
+    header.triangleOffset = alignOffset(header.nodeOffset + nodeSize * nodeCount);
+    header.triangleCount = m_triangles.size();
+    header.meshOffset = alignOffset(header.triangleOffset + sizeof(TriangleGroup) * header.triangleCount);
+    header.meshCount = m_meshes.size();
+    uint64_t fileSize = header.meshOffset + sizeof(CacheMesh) * header.meshCount;
+
+    /* Lay out the buffers of all meshes after the mesh records */
+    std::vector<CacheMesh> meshes(m_meshes.size());
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        const Mesh *mesh = m_meshes[i];
+        CacheMesh &record = meshes[i];
+        memset(&record, 0, sizeof(CacheMesh));
+        record.vertexCount = mesh->getVertexCount();
+        record.triangleCount = mesh->getTriangleCount();
+        const BoundingBox3f &bbox = mesh->getBoundingBox();
+        for (int j = 0; j < 3; ++j) {
+            record.bbox[j] = bbox.min[j];
+            record.bbox[j + 3] = bbox.max[j];
+        }
+        auto allocate = [&](uint64_t bytes) {
+            uint64_t offset = alignOffset(fileSize);
+            fileSize = offset + bytes;
+            return offset;
+        };
+        record.positionOffset = allocate(sizeof(float) * mesh->getVertexPositions().size());
+        if (mesh->getVertexNormals().size() > 0)
+            record.normalOffset = allocate(sizeof(float) * mesh->getVertexNormals().size());
+        if (mesh->getVertexTexCoords().size() > 0)
+            record.texcoordOffset = allocate(sizeof(float) * mesh->getVertexTexCoords().size());
+        record.indexOffset = allocate(sizeof(uint32_t) * mesh->getIndices().size());
+    }
+
+    /* Write to a temporary file first, so that other processes
+       never observe a partially written cache file */
+    std::string tempFilename = filename + ".tmp";
+    std::ofstream os(tempFilename, std::ios::binary | std::ios::trunc);
+    const char padding[CACHE_ALIGNMENT] = { 0 };
+    uint64_t position = 0;
+    auto write = [&](uint64_t offset, const void *data, uint64_t bytes) {
+        os.write(padding, offset - position);
+        os.write((const char *) data, bytes);
+        position = offset + bytes;
+    };
+    write(0, &header, sizeof(CacheHeader));
+    write(header.nodeOffset, nodes, nodeSize * nodeCount);
+    write(header.triangleOffset, m_triangles.data(), sizeof(TriangleGroup) * header.triangleCount);
+    write(header.meshOffset, meshes.data(), sizeof(CacheMesh) * header.meshCount);
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        const Mesh *mesh = m_meshes[i];
+        const CacheMesh &record = meshes[i];
+        write(record.positionOffset, mesh->getVertexPositions().data(),
+              sizeof(float) * mesh->getVertexPositions().size());
+        if (record.normalOffset)
+            write(record.normalOffset, mesh->getVertexNormals().data(),
+                  sizeof(float) * mesh->getVertexNormals().size());
+        if (record.texcoordOffset)
+            write(record.texcoordOffset, mesh->getVertexTexCoords().data(),
+                  sizeof(float) * mesh->getVertexTexCoords().size());
+        write(record.indexOffset, mesh->getIndices().data(),
+              sizeof(uint32_t) * mesh->getIndices().size());
+    }
+    os.close();
+
+    if (!os) {
+        std::remove(tempFilename.c_str());
+        cout << "failed!" << endl;
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"" << endl;
+        return;
+    }
+
+    std::remove(filename.c_str());
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(tempFilename.c_str());
+        cout << "failed!" << endl;
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"" << endl;
+        return;
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(fileSize) << ")." << endl;
+}
+
+NORI_NAMESPACE_END
@@ -1,25 +1,77 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
 #include <nori/emitter.h>
+#include <nori/mesh.h>
 
 NORI_NAMESPACE_BEGIN
 
-class AreaLight : public Emitter
-{
+/**
+ * \brief Diffuse area light that emits a constant radiance
+ * from the front side of a mesh
+ */
+class AreaLight : public Emitter {
 public:
+    AreaLight(const PropertyList &propList) {
+        m_radiance = propList.getColor("radiance");
+    }
+
+    Color3f sample(EmitterQueryRecord &lRec, const Point2f &sample) const {
+        if (!m_mesh)
+            throw NoriException("AreaLight: not attached to a mesh!");
 
-    AreaLight(const PropertyList &props)
-    {
-        radiance = props.getColor("radiance");
+        /* Sample a position uniformly with respect to surface area */
+        Point3f p;
+        Normal3f n;
+        lRec.triangle = m_mesh->samplePosition(sample, p, n);
+        lRec.emitter = this;
+        lRec.setPosition(p, n);
+        lRec.pdf = pdf(lRec);
+        if (lRec.pdf == 0)
+            return Color3f(0.0f);
+        return eval(lRec) / lRec.pdf;
     }
 
-	string toString() const
-	{
-		return "AreaLight[]";
-	}
+    Color3f eval(const EmitterQueryRecord &lRec) const {
+        /* Only the side the normal points to is emitting */
+        if (lRec.n.dot(lRec.wi) >= 0)
+            return Color3f(0.0f);
+        return m_radiance;
+    }
 
-private:
+    float pdf(const EmitterQueryRecord &lRec) const {
+        if (!m_mesh)
+            return 0.0f;
+        return lRec.toSolidAngle(1.0f / m_mesh->getSurfaceArea());
+    }
+
+    Color3f getRadiance() const { return m_radiance; }
 
-    Color3f radiance;
+    std::string toString() const {
+        return tfm::format(
+            "AreaLight[\n"
+            "  radiance = %s\n"
+            "]", m_radiance.toString());
+    }
+
+private:
+    Color3f m_radiance;
 };
 
- NORI_REGISTER_CLASS(AreaLight, "area");
-NORI_NAMESPACE_END
\ No newline at end of file
+NORI_REGISTER_CLASS(AreaLight, "area");
+NORI_NAMESPACE_END
@@ -0,0 +1,232 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/* Layout of Nori's binary mesh format (".nbm")
+
+   The header is followed by the vertex positions (3 floats per vertex),
+   the optional normals (3 floats per vertex) and texture coordinates
+   (2 floats per vertex), and the triangle indices (3 uint32_t per
+   triangle). All arrays start at a multiple of 64 bytes and use the
+   column-major layout of the Eigen matrices in \ref Mesh, so that
+   they can be used directly from a memory-mapped file. */
+
+/// Increment whenever the layout of the format changes
+static const uint32_t BINARY_MESH_VERSION = 1;
+
+/// Alignment of the arrays within a binary mesh file
+static const uint64_t BINARY_MESH_ALIGNMENT = 64;
+
+struct BinaryMeshHeader {
+    char     magic[8];          ///< Identifier ("NORIMSH")
+    uint32_t version;           ///< Format version (\ref BINARY_MESH_VERSION)
+    uint32_t flags;             ///< 1: has normals, 2: has texture coordinates
+    uint32_t vertexCount;       ///< Number of vertices
+    uint32_t triangleCount;     ///< Number of triangles
+    float    bbox[6];           ///< Bounding box (min.x, min.y, min.z, max.x, ..)
+    uint64_t positionOffset;    ///< Byte offset of the vertex positions
+    uint64_t normalOffset;      ///< Byte offset of the normals (or 0)
+    uint64_t texcoordOffset;    ///< Byte offset of the texture coordinates (or 0)
+    uint64_t indexOffset;       ///< Byte offset of the triangle indices
+};
+
+enum {
+    EHasNormals = 1,
+    EHasTexCoords = 2
+};
+
+/// Round up to the next multiple of \ref BINARY_MESH_ALIGNMENT
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + BINARY_MESH_ALIGNMENT - 1) / BINARY_MESH_ALIGNMENT * BINARY_MESH_ALIGNMENT;
+}
+
+void Mesh::writeBinary(const std::string &filename) const {
+    cout << "Writing \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    BinaryMeshHeader header;
+    memset(&header, 0, sizeof(BinaryMeshHeader));
+    memcpy(header.magic, "NORIMSH", 8);
+    header.version = BINARY_MESH_VERSION;
+    header.flags = (m_N.size() > 0 ? EHasNormals : 0) | (m_UV.size() > 0 ? EHasTexCoords : 0);
+    header.vertexCount = getVertexCount();
+    header.triangleCount = getTriangleCount();
+    for (int axis = 0; axis < 3; ++axis) {
+        header.bbox[axis] = m_bbox.min[axis];
+        header.bbox[axis + 3] = m_bbox.max[axis];
+    }
+
+    uint64_t offset = alignOffset(sizeof(BinaryMeshHeader));
+    header.positionOffset = offset;
+    offset = alignOffset(offset + sizeof(float) * m_V.size());
+    if (m_N.size() > 0) {
+        header.normalOffset = offset;
+        offset = alignOffset(offset + sizeof(float) * m_N.size());
+    }
+    if (m_UV.size() > 0) {
+        header.texcoordOffset = offset;
+        offset = alignOffset(offset + sizeof(float) * m_UV.size());
+    }
+    header.indexOffset = offset;
+    offset += sizeof(uint32_t) * m_F.size();
+
+    std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+    if (os.fail())
+        throw NoriException("Unable to open \"%s\" for writing!", filename);
+
+    const char padding[BINARY_MESH_ALIGNMENT] = { 0 };
+    auto write = [&](uint64_t position, const void *data, size_t size) {
+        os.write(padding, (std::streamsize) (position - (uint64_t) os.tellp()));
+        os.write((const char *) data, (std::streamsize) size);
+    };
+
+    write(0, &header, sizeof(BinaryMeshHeader));
+    write(header.positionOffset, m_V.data(), sizeof(float) * m_V.size());
+    if (header.normalOffset)
+        write(header.normalOffset, m_N.data(), sizeof(float) * m_N.size());
+    if (header.texcoordOffset)
+        write(header.texcoordOffset, m_UV.data(), sizeof(float) * m_UV.size());
+    write(header.indexOffset, m_F.data(), sizeof(uint32_t) * m_F.size());
+
+    if (os.fail())
+        throw NoriException("Error while writing \"%s\"!", filename);
+
+    cout << "done. (V=" << header.vertexCount << ", F=" << header.triangleCount
+         << ", took " << timer.elapsedString() << " and " << memString(offset) << ")" << endl;
+}
+
+/**
+ * \brief Loader for meshes in Nori's binary format
+ *
+ * The file is memory-mapped and its buffers are used in place, which
+ * makes loading nearly instantaneous. When a \c toWorld transformation
+ * is specified, the vertex positions and normals are transformed into
+ * a separate copy instead. Use <tt>nori --convert</tt> to create such
+ * files from Wavefront OBJ meshes.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        m_name = getFileResolver()->resolve(propList.getString("filename")).str();
+        m_trafo = propList.getTransform("toWorld", Transform());
+
+        /* The file is only mapped by loadBuffers(), but it must exist */
+        m_fileID = getFileID(m_name);
+    }
+
+    std::string getSourceID() const {
+        std::string id = "binary:" + m_fileID;
+        for (int i = 0; i < 16; ++i)
+            id += tfm::format(":%.9g", m_trafo.getMatrix()(i / 4, i % 4));
+        return id;
+    }
+
+protected:
+    void loadBuffers() {
+        const std::string &filename = m_name;
+        const Transform &trafo = m_trafo;
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        m_file.reset(new MemoryMappedFile(filename));
+        const uint8_t *data = m_file->data();
+        size_t size = m_file->size();
+
+        BinaryMeshHeader header;
+        if (size < sizeof(BinaryMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        memcpy(&header, data, sizeof(BinaryMeshHeader));
+
+        if (memcmp(header.magic, "NORIMSH", 8) != 0)
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        if (header.version != BINARY_MESH_VERSION)
+            throw NoriException("\"%s\" has an unsupported version (%i, expected %i)!",
+                                filename, header.version, BINARY_MESH_VERSION);
+
+        uint64_t vertexCount = header.vertexCount, triangleCount = header.triangleCount;
+        auto check = [&](uint64_t offset, uint64_t bytes) {
+            if (offset % sizeof(float) != 0 || offset + bytes > size)
+                throw NoriException("\"%s\" is truncated or corrupt!", filename);
+        };
+        check(header.positionOffset, sizeof(float) * 3 * vertexCount);
+        if (header.flags & EHasNormals)
+            check(header.normalOffset, sizeof(float) * 3 * vertexCount);
+        if (header.flags & EHasTexCoords)
+            check(header.texcoordOffset, sizeof(float) * 2 * vertexCount);
+        check(header.indexOffset, sizeof(uint32_t) * 3 * triangleCount);
+
+        const float *V  = (const float *) (data + header.positionOffset);
+        const float *N  = (header.flags & EHasNormals) ?
+            (const float *) (data + header.normalOffset) : nullptr;
+        const float *UV = (header.flags & EHasTexCoords) ?
+            (const float *) (data + header.texcoordOffset) : nullptr;
+        const uint32_t *F = (const uint32_t *) (data + header.indexOffset);
+
+        if (trafo.getMatrix().isIdentity()) {
+            /* Use the mapped buffers in place */
+            m_bbox = BoundingBox3f(
+                Point3f(header.bbox[0], header.bbox[1], header.bbox[2]),
+                Point3f(header.bbox[3], header.bbox[4], header.bbox[5]));
+        } else {
+            m_positions.resize(3, vertexCount);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                Point3f p = trafo * Point3f(V[3*i], V[3*i+1], V[3*i+2]);
+                m_bbox.expandBy(p);
+                m_positions.col(i) = p;
+            }
+            V = m_positions.data();
+
+            if (N) {
+                m_normals.resize(3, vertexCount);
+                for (uint32_t i = 0; i < vertexCount; ++i)
+                    m_normals.col(i) = (trafo * Normal3f(N[3*i], N[3*i+1], N[3*i+2])).normalized();
+                N = m_normals.data();
+            }
+        }
+
+        setBuffers(V, N, UV, F, header.vertexCount, header.triangleCount);
+
+        /* Out-of-range indices would make every later query read outside the mapping */
+        if (m_F.size() > 0 && m_F.maxCoeff() >= vertexCount)
+            throw NoriException("\"%s\" contains an invalid vertex index!", filename);
+
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and " << memString(size) << " mapped)" << endl;
+    }
+
+    std::unique_ptr<MemoryMappedFile> m_file; ///< Mapped contents of the mesh file
+    MatrixXf m_positions;   ///< Transformed vertex positions (if there is a \c toWorld transformation)
+    MatrixXf m_normals;     ///< Transformed vertex normals (if there is a \c toWorld transformation)
+    Transform m_trafo;      ///< Transformation that is applied to the vertices
+    std::string m_fileID;   ///< Identifier of the file (see \ref getFileID())
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "binary");
+NORI_NAMESPACE_END
@@ -17,16 +17,57 @@
 */
 
 #include <nori/bitmap.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
 #include <ImfInputFile.h>
 #include <ImfOutputFile.h>
 #include <ImfChannelList.h>
 #include <ImfStringAttribute.h>
+#include <ImfThreading.h>
 #include <ImfVersion.h>
 #include <ImfIO.h>
+#include <half.h>
+#include <tbb/tbb.h>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
+Bitmap::ECompression Bitmap::compressionFromString(const std::string &name) {
+    std::string value = toLower(name);
+    if (value == "none")
+        return ENoCompression;
+    else if (value == "zip")
+        return EZipCompression;
+    else if (value == "piz")
+        return EPizCompression;
+    else if (value == "dwaa")
+        return EDwaaCompression;
+    throw NoriException("Unknown OpenEXR compression method \"%s\" "
+        "(must be none, zip, piz, or dwaa)!", name);
+}
+
+std::string Bitmap::compressionToString(ECompression compression) {
+    switch (compression) {
+        case ENoCompression: return "none";
+        case EZipCompression: return "zip";
+        case EPizCompression: return "piz";
+        case EDwaaCompression: return "dwaa";
+        default: return "<unknown>";
+    }
+}
+
+void Bitmap::initThreadPool() {
+    static std::once_flag flag;
+    std::call_once(flag, [] {
+        /* Scanline blocks are (de)compressed in parallel on these threads */
+        Imf::setGlobalThreadCount(tbb::task_scheduler_init::default_num_threads());
+    });
+}
+
 Bitmap::Bitmap(const std::string &filename) {
+    initThreadPool();
+    Timer timer;
+
     Imf::InputFile file(filename.c_str());
     const Imf::Header &header = file.header();
     const Imf::ChannelList &channels = header.channels();
@@ -35,7 +76,8 @@ Bitmap::Bitmap(const std::string &filename) {
     resize(dw.max.y - dw.min.y + 1, dw.max.x - dw.min.x + 1);
 
     cout << "Reading a " << cols() << "x" << rows() << " OpenEXR file from \""
-         << filename << "\"" << endl;
+         << filename << "\" .. ";
+    cout.flush();
 
     const char *ch_r = nullptr, *ch_g = nullptr, *ch_b = nullptr;
     for (Imf::ChannelList::ConstIterator it = channels.begin(); it != channels.end(); ++it) {
@@ -73,33 +115,74 @@ Bitmap::Bitmap(const std::string &filename) {
     frameBuffer.insert(ch_b, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); 
     file.setFrameBuffer(frameBuffer);
     file.readPixels(dw.min.y, dw.max.y);
+
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
 }
 
-void Bitmap::save(const std::string &filename) {
+void Bitmap::save(const std::string &filename, ECompression compression, bool halfFloat) {
+    initThreadPool();
+
     cout << "Writing a " << cols() << "x" << rows() 
-         << " OpenEXR file to \"" << filename << "\"" << endl;
+         << " OpenEXR file to \"" << filename << "\" ("
+         << compressionToString(compression) << (halfFloat ? ", half" : "") << ") .. ";
+    cout.flush();
+    Timer timer;
 
     Imf::Header header((int) cols(), (int) rows());
     header.insert("comments", Imf::StringAttribute("Generated by Nori"));
 
+    switch (compression) {
+        case ENoCompression: header.compression() = Imf::NO_COMPRESSION; break;
+        case EZipCompression: header.compression() = Imf::ZIP_COMPRESSION; break;
+        case EPizCompression: header.compression() = Imf::PIZ_COMPRESSION; break;
+        case EDwaaCompression: header.compression() = Imf::DWAA_COMPRESSION; break;
+    }
+
+    Imf::PixelType type = halfFloat ? Imf::HALF : Imf::FLOAT;
     Imf::ChannelList &channels = header.channels();
-    channels.insert("R", Imf::Channel(Imf::FLOAT));
-    channels.insert("G", Imf::Channel(Imf::FLOAT));
-    channels.insert("B", Imf::Channel(Imf::FLOAT));
+    channels.insert("R", Imf::Channel(type));
+    channels.insert("G", Imf::Channel(type));
+    channels.insert("B", Imf::Channel(type));
+
+    /* Convert to half precision up front, which is cheaper in parallel
+       than letting OpenEXR do it while compressing */
+    std::vector<half> halfData;
+    char *ptr = reinterpret_cast<char *>(data());
+    size_t compStride = sizeof(float);
+    if (halfFloat) {
+        halfData.resize(3 * size());
+        tbb::parallel_for(tbb::blocked_range<Index>(0, rows()),
+            [&](const tbb::blocked_range<Index> &range) {
+                for (Index y=range.begin(); y<range.end(); ++y) {
+                    const float *source = reinterpret_cast<const float *>(data() + y * cols());
+                    half *target = halfData.data() + 3 * y * cols();
+                    for (Index i=0; i<3 * cols(); ++i)
+                        target[i] = source[i];
+                }
+            }
+        );
+        ptr = reinterpret_cast<char *>(halfData.data());
+        compStride = sizeof(half);
+    }
 
     Imf::FrameBuffer frameBuffer;
-    size_t compStride = sizeof(float),
-           pixelStride = 3 * compStride,
+    size_t pixelStride = 3 * compStride,
            rowStride = pixelStride * cols();
 
-    char *ptr = reinterpret_cast<char *>(data());
-    frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-    frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
-    frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); 
+    frameBuffer.insert("R", Imf::Slice(type, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("G", Imf::Slice(type, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("B", Imf::Slice(type, ptr, pixelStride, rowStride)); 
 
-    Imf::OutputFile file(filename.c_str(), header);
-    file.setFrameBuffer(frameBuffer);
-    file.writePixels((int) rows());
+    {
+        Imf::OutputFile file(filename.c_str(), header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels((int) rows());
+    }
+
+    size_t fileSize = filesystem::path(filename).file_size();
+    cout << "done. (took " << timer.elapsedString() << ", " << memString(fileSize)
+         << tfm::format(", %.1f%% of the raw size)", 100.0 * fileSize / (size() * sizeof(Color3f)))
+         << endl;
 }
 
 NORI_NAMESPACE_END
@@ -20,10 +20,29 @@
 #include <nori/bitmap.h>
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
 #include <tbb/tbb.h>
+#include <thread>
+#include <fstream>
+#include <cstdio>
 
 NORI_NAMESPACE_BEGIN
 
+std::atomic<size_t> ImageBlock::m_invalidSamples(0);
+
+/// Increment whenever the layout of checkpoint files changes
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+/// Header of a checkpoint file, followed by the pixels of the image block
+struct CheckpointHeader {
+    char     magic[8];          ///< Identifier ("NORICHK")
+    uint32_t version;           ///< Format version (\ref CHECKPOINT_VERSION)
+    uint32_t sampleCount;       ///< Samples per pixel accumulated so far
+    uint64_t key;               ///< Identifies the render
+    uint32_t rows, cols;        ///< Size of the pixel array (including the border)
+};
+
 ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter) 
         : m_offset(0, 0), m_size(size) {
     if (filter) {
@@ -37,21 +56,34 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
         }
         m_filter[NORI_FILTER_RESOLUTION] = 0.0f;
         m_lookupFactor = NORI_FILTER_RESOLUTION / m_filterRadius;
-        int weightSize = (int) std::ceil(2*m_filterRadius) + 1;
-        m_weightsX = new float[weightSize];
-        m_weightsY = new float[weightSize];
-        memset(m_weightsX, 0, sizeof(float) * weightSize);
-        memset(m_weightsY, 0, sizeof(float) * weightSize);
+
+        /* Number of pixels along each axis that a sample can reach */
+        m_splatWidth = (int) std::floor(2*m_filterRadius) + 1;
+        if (m_splatWidth > NORI_MAX_SPLAT_WIDTH)
+            throw NoriException("ImageBlock: the reconstruction filter radius "
+                "(%f) is too large!", m_filterRadius);
+
+        /* A constant filter that doesn't extend past the pixel containing
+           the sample (e.g. the box filter) requires no splatting at all */
+        m_splatPixel = m_filterRadius <= 0.5f;
+        for (int i=1; i<NORI_FILTER_RESOLUTION; ++i)
+            m_splatPixel &= m_filter[i] == m_filter[0];
     }
 
     /* Allocate space for pixels and border regions */
     resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+
+    /* One flag per tile, which is set when the tile changes */
+    m_dirtyTiles = Vector2i(
+        (size.x() + NORI_BLOCK_SIZE - 1) / NORI_BLOCK_SIZE,
+        (size.y() + NORI_BLOCK_SIZE - 1) / NORI_BLOCK_SIZE);
+    m_dirty.reset(new std::atomic<bool>[m_dirtyTiles.prod()]);
+    for (int i=0; i<m_dirtyTiles.prod(); ++i)
+        m_dirty[i] = false;
 }
 
 ImageBlock::~ImageBlock() {
     delete[] m_filter;
-    delete[] m_weightsX;
-    delete[] m_weightsY;
 }
 
 Bitmap *ImageBlock::toBitmap() const {
@@ -74,7 +106,9 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
 void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
     if (!value.isValid()) {
         /* If this happens, go fix your code instead of removing this warning ;) */
-        cerr << "Integrator: computed an invalid radiance value: " << value.toString() << endl;
+        if (m_invalidSamples++ == 0)
+            cerr << "Integrator: computed an invalid radiance value: " << value.toString()
+                 << " (further occurrences will only be counted)" << endl;
         return;
     }
 
@@ -84,22 +118,68 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
         _pos.y() - 0.5f - (m_offset.y() - m_borderSize)
     );
 
-    /* Compute the rectangle of pixels that will need to be updated */
-    BoundingBox2i bbox(
-        Point2i((int)  std::ceil(pos.x() - m_filterRadius), (int)  std::ceil(pos.y() - m_filterRadius)),
-        Point2i((int) std::floor(pos.x() + m_filterRadius), (int) std::floor(pos.y() + m_filterRadius))
-    );
-    bbox.clip(BoundingBox2i(Point2i(0, 0), Point2i((int) cols() - 1, (int) rows() - 1)));
+    if (m_splatPixel) {
+        /* Only the pixel containing the sample is affected */
+        int x = (int) std::floor(pos.x() + 0.5f), y = (int) std::floor(pos.y() + 0.5f);
+        if (x >= 0 && y >= 0 && x < cols() && y < rows())
+            coeffRef(y, x) += Color4f(value) * m_filter[0];
+        return;
+    }
+
+    if (m_splatWidth > cols() || m_splatWidth > rows()) {
+        /* The footprint doesn't fit into this (tiny) block */
+        splat<0>(pos, value);
+        return;
+    }
+
+    /* Dispatch to kernels with a fixed footprint: 3x3 for the tent filter,
+       5x5 for the Gaussian and Mitchell-Netravali filters (radius 2), .. */
+    switch (m_splatWidth) {
+        case 1: splat<1>(pos, value); break;
+        case 2: splat<2>(pos, value); break;
+        case 3: splat<3>(pos, value); break;
+        case 4: splat<4>(pos, value); break;
+        case 5: splat<5>(pos, value); break;
+        case 6: splat<6>(pos, value); break;
+        case 7: splat<7>(pos, value); break;
+        case 8: splat<8>(pos, value); break;
+        default: splat<0>(pos, value); break;
+    }
+}
+
+template <int Width> void ImageBlock::splat(const Point2f &pos, const Color3f &value) {
+    const int width = Width > 0 ? Width : m_splatWidth;
+
+    /* First pixel of the footprint, shifted into the block if possible */
+    int x0 = (int) std::ceil(pos.x() - m_filterRadius);
+    int y0 = (int) std::ceil(pos.y() - m_filterRadius);
+    int xStart = 0, yStart = 0, xEnd = width, yEnd = width;
+    if (Width > 0) {
+        x0 = std::max(0, std::min(x0, (int) cols() - width));
+        y0 = std::max(0, std::min(y0, (int) rows() - width));
+    } else {
+        /* General case: clip the footprint against the block */
+        xStart = std::max(0, -x0); xEnd = std::min(width, (int) cols() - x0);
+        yStart = std::max(0, -y0); yEnd = std::min(width, (int) rows() - y0);
+    }
 
-    /* Lookup values from the pre-rasterized filter */
-    for (int x=bbox.min.x(), idx = 0; x<=bbox.max.x(); ++x)
-        m_weightsX[idx++] = m_filter[(int) (std::abs(x-pos.x()) * m_lookupFactor)];
-    for (int y=bbox.min.y(), idx = 0; y<=bbox.max.y(); ++y)
-        m_weightsY[idx++] = m_filter[(int) (std::abs(y-pos.y()) * m_lookupFactor)];
+    /* Lookup values from the pre-rasterized filter (which is zero
+       at the end of the table, i.e. outside of the filter support) */
+    float weightsX[Width > 0 ? Width : NORI_MAX_SPLAT_WIDTH];
+    float weightsY[Width > 0 ? Width : NORI_MAX_SPLAT_WIDTH];
+    for (int i=0; i<width; ++i) {
+        weightsX[i] = m_filter[std::min((int) (std::abs(x0 + i - pos.x()) * m_lookupFactor),
+                                        NORI_FILTER_RESOLUTION)];
+        weightsY[i] = m_filter[std::min((int) (std::abs(y0 + i - pos.y()) * m_lookupFactor),
+                                        NORI_FILTER_RESOLUTION)];
+    }
 
-    for (int y=bbox.min.y(), yr=0; y<=bbox.max.y(); ++y, ++yr) 
-        for (int x=bbox.min.x(), xr=0; x<=bbox.max.x(); ++x, ++xr) 
-            coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
+    Color4f color(value);
+    for (int y=yStart; y<yEnd; ++y) {
+        Color4f rowColor = color * weightsY[y];
+        for (int x=xStart; x<xEnd; ++x)
+            coeffRef(y0 + y, x0 + x) += rowColor * weightsX[x];
+    }
 }
     
 void ImageBlock::put(ImageBlock &b) {
@@ -107,10 +187,143 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    /* Other blocks reach at most one border width into this block's
+       rectangle, hence only pixels within two border widths of the edge
+       of 'b' can receive contributions from elsewhere */
+    int ring = 2 * b.getBorderSize();
+    int x0 = std::min(ring, size.x()), x1 = std::max(x0, size.x() - ring);
+
+    auto add = [&](int y, int x, int width) {
+        block(offset.y() + y, offset.x() + x, 1, width) += b.block(y, x, 1, width);
+    };
+
+    for (int y=0; y<size.y(); ++y) {
+        bool shared = y < ring || y >= size.y() - ring;
+        {
+            tbb::mutex::scoped_lock lock(
+                m_stripes[(offset.y() + y) % NORI_BLOCK_STRIPES]);
+            if (shared) {
+                add(y, 0, size.x());
+                continue;
+            }
+            add(y, 0, x0);
+            add(y, x1, size.x() - x1);
+        }
+        add(y, x0, x1 - x0);
+    }
+
+    /* Flag the tiles touched by 'b' (including its border) as changed */
+    Point2i min = (b.getOffset() - m_offset - Vector2i::Constant(b.getBorderSize()))
+        .cwiseMax(Point2i(0, 0));
+    Point2i max = (b.getOffset() - m_offset + b.getSize() + Vector2i::Constant(b.getBorderSize()))
+        .cwiseMin(m_size);
+    if ((max.array() <= min.array()).any())
+        return;
+    min /= NORI_BLOCK_SIZE;
+    max = (max - Vector2i::Ones()) / NORI_BLOCK_SIZE;
+    for (int y=min.y(); y<=max.y(); ++y)
+        for (int x=min.x(); x<=max.x(); ++x)
+            m_dirty[y * m_dirtyTiles.x() + x].store(true, std::memory_order_release);
+}
+
+void ImageBlock::takeDirtyRegions(std::vector<Region> &regions) const {
+    regions.clear();
+    for (int y=0; y<m_dirtyTiles.y(); ++y) {
+        for (int x=0; x<m_dirtyTiles.x(); ) {
+            if (!m_dirty[y * m_dirtyTiles.x() + x].exchange(false, std::memory_order_acquire)) {
+                ++x;
+                continue;
+            }
+
+            /* Extend the region over the following changed tiles of this row */
+            int end = x + 1;
+            while (end < m_dirtyTiles.x() &&
+                   m_dirty[y * m_dirtyTiles.x() + end].exchange(false, std::memory_order_acquire))
+                ++end;
+
+            Region region;
+            region.offset = Point2i(x, y) * NORI_BLOCK_SIZE;
+            region.size = (Point2i(end, y + 1) * NORI_BLOCK_SIZE).cwiseMin(m_size) - region.offset;
+            regions.push_back(region);
+            x = end;
+        }
+    }
+}
+
+void ImageBlock::snapshot(const Region &region, Color4f *target) const {
+    for (int y=0; y<region.size.y(); ++y) {
+        int row = region.offset.y() + y + m_borderSize;
+        tbb::mutex::scoped_lock lock(m_stripes[row % NORI_BLOCK_STRIPES]);
+        const Color4f *source = data() + row * cols() + region.offset.x() + m_borderSize;
+        std::copy(source, source + region.size.x(), target + y * region.size.x());
+    }
+}
+
+void ImageBlock::saveCheckpoint(const std::string &filename, uint64_t key,
+                                uint32_t sampleCount) const {
+    cout << "Writing checkpoint \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    memcpy(header.magic, "NORICHK", 8);
+    header.version = CHECKPOINT_VERSION;
+    header.sampleCount = sampleCount;
+    header.key = key;
+    header.rows = (uint32_t) rows();
+    header.cols = (uint32_t) cols();
+    size_t dataSize = sizeof(Color4f) * size();
+
+    /* Write to a temporary file first, so that a render which is killed
+       while writing still leaves the previous checkpoint intact */
+    std::string tempFilename = filename + ".tmp";
+    std::ofstream os(tempFilename, std::ios::binary | std::ios::trunc);
+    os.write((const char *) &header, sizeof(CheckpointHeader));
+    os.write((const char *) data(), dataSize);
+    os.close();
+
+#if defined(PLATFORM_WINDOWS)
+    std::remove(filename.c_str());
+#endif
+    if (!os || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(tempFilename.c_str());
+        cout << "failed!" << endl;
+        cerr << "Warning: unable to write the checkpoint file \"" << filename << "\"" << endl;
+        return;
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(CheckpointHeader) + dataSize) << ")." << endl;
+}
+
+uint32_t ImageBlock::loadCheckpoint(const std::string &filename, uint64_t key) {
+    if (!filesystem::path(filename).exists())
+        return 0;
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+    cout << "Loading checkpoint \"" << filename << "\" .. ";
+    cout.flush();
+
+    std::ifstream is(filename, std::ios::binary);
+    CheckpointHeader header;
+    is.read((char *) &header, sizeof(CheckpointHeader));
+
+    if (!is || memcmp(header.magic, "NORICHK", 8) != 0 ||
+        header.version != CHECKPOINT_VERSION || header.key != key ||
+        header.rows != (uint32_t) rows() || header.cols != (uint32_t) cols()) {
+        cout << "failed (incompatible file), starting over." << endl;
+        return 0;
+    }
+
+    is.read((char *) data(), sizeof(Color4f) * size());
+    if (!is) {
+        clear();
+        cout << "failed (truncated file), starting over." << endl;
+        return 0;
+    }
+
+    cout << "done (" << header.sampleCount << " samples per pixel)." << endl;
+    return header.sampleCount;
 }
 
 std::string ImageBlock::toString() const {
@@ -118,48 +331,116 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, EOrder order)
+        : m_size(size), m_blockSize(blockSize), m_cursor(0) {
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+    m_blocks.reserve(m_numBlocks.x() * m_numBlocks.y());
+
+    if (order == EHilbert)
+        generateHilbert();
+    else
+        generateSpiral();
+
+    splitTail();
 }
 
-bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
+void BlockGenerator::addBlock(const Point2i &block) {
+    Point2i pos = block * m_blockSize;
+    m_blocks.push_back(Block {
+        pos, (m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)) });
+}
 
-    if (m_blocksLeft == 0)
-        return false;
+void BlockGenerator::generateSpiral() {
+    int blocksLeft = m_numBlocks.x() * m_numBlocks.y();
+    int direction = ERight, numSteps = 1, stepsLeft = 1;
+    Point2i block(m_numBlocks / 2);
+
+    while (blocksLeft > 0) {
+        addBlock(block);
 
-    Point2i pos = m_block * m_blockSize;
-    block.setOffset(pos);
-    block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+        if (--blocksLeft == 0)
+            break;
 
-    if (--m_blocksLeft == 0)
-        return true;
+        do {
+            switch (direction) {
+                case ERight: ++block.x(); break;
+                case EDown:  ++block.y(); break;
+                case ELeft:  --block.x(); break;
+                case EUp:    --block.y(); break;
+            }
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
+            if (--stepsLeft == 0) {
+                direction = (direction + 1) % 4;
+                if (direction == ELeft || direction == ERight) 
+                    ++numSteps;
+                stepsLeft = numSteps;
+            }
+        } while ((block.array() < 0).any() ||
+                 (block.array() >= m_numBlocks.array()).any());
+    }
+}
+
+void BlockGenerator::generateHilbert() {
+    /* Walk a Hilbert curve over the smallest enclosing power-of-two
+       grid and skip the cells outside of the image */
+    int n = 1;
+    while (n < m_numBlocks.maxCoeff())
+        n *= 2;
+
+    for (int d = 0; d < n * n; ++d) {
+        int x = 0, y = 0, t = d;
+        for (int s = 1; s < n; s *= 2) {
+            int rx = 1 & (t / 2), ry = 1 & (t ^ rx);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+            t /= 4;
         }
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+        if (x < m_numBlocks.x() && y < m_numBlocks.y())
+            addBlock(Point2i(x, y));
+    }
+}
+
+void BlockGenerator::splitTail() {
+    if (m_blockSize < 2)
+        return;
+
+    /* Threads finish their last blocks at different times. Splitting the
+       final blocks (two per core) keeps all of them busy until the end */
+    size_t tail = std::min(m_blocks.size(),
+        (size_t) 2 * std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<Block> blocks(m_blocks.end() - tail, m_blocks.end());
+    m_blocks.resize(m_blocks.size() - tail);
+
+    int half = (m_blockSize + 1) / 2;
+    for (const Block &b : blocks) {
+        for (int y = 0; y < b.size.y(); y += half) {
+            for (int x = 0; x < b.size.x(); x += half) {
+                Vector2i offset(x, y);
+                m_blocks.push_back(Block {
+                    b.offset + offset, (b.size - offset).cwiseMin(Vector2i::Constant(half)) });
+            }
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+    }
+}
+
+bool BlockGenerator::next(ImageBlock &block) {
+    int index = m_cursor.fetch_add(1, std::memory_order_relaxed);
+    if (index >= (int) m_blocks.size())
+        return false;
 
+    const Block &b = m_blocks[index];
+    block.setOffset(b.offset);
+    block.setSize(b.size);
     return true;
 }
 
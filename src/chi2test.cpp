@@ -97,6 +97,11 @@ public:
         std::unique_ptr<double[]> obsFrequencies(new double[res]);
         std::unique_ptr<double[]> expFrequencies(new double[res]);
 
+        std::vector<Point2f> samples(BATCH_SIZE);
+        std::vector<BSDFQueryRecord> scalarRecs(BATCH_SIZE, BSDFQueryRecord(Vector3f(0.0f)));
+        std::vector<BSDFQueryRecord> batchRecs(BATCH_SIZE, BSDFQueryRecord(Vector3f(0.0f)));
+        std::vector<Color3f> scalarValues(BATCH_SIZE), batchValues(BATCH_SIZE);
+        std::vector<float> batchPdfs(BATCH_SIZE);
 
         /* Test each registered BSDF */
         for (auto bsdf : m_bsdfs) {
@@ -120,28 +125,64 @@ public:
                 cout.flush();
 
                 /* Generate many samples from the BSDF and create
-                   a histogram / contingency table */
+                   a histogram / contingency table. The samples are also
+                   drawn using the batched interface, which must agree
+                   with the scalar implementation */
                 BSDFQueryRecord bRec(wi);
-                for (int i=0; i<m_sampleCount; ++i) {
-                    Point2f sample(random.nextFloat(), random.nextFloat());
-                    Color3f result = bsdf->sample(bRec, sample);
-
-                    if ((result.array() == 0).all())
-                        continue;
-
-                    int cosThetaBin = std::min(std::max(0, (int) std::floor((bRec.wo.z()*0.5f+0.5f)
-                            * m_cosThetaResolution)), m_cosThetaResolution-1);
-
-                    float scaledPhi = std::atan2(bRec.wo.y(), bRec.wo.x()) * INV_TWOPI;
-                    if (scaledPhi < 0)
-                        scaledPhi += 1;
+                int mismatches = 0;
+                for (int i=0; i<m_sampleCount; i += BATCH_SIZE) {
+                    int count = std::min((int) BATCH_SIZE, m_sampleCount - i);
+                    for (int j=0; j<count; ++j)
+                        samples[j] = Point2f(random.nextFloat(), random.nextFloat());
+
+                    std::fill(batchRecs.begin(), batchRecs.begin() + count, bRec);
+                    bsdf->sampleBatch(batchRecs.data(), samples.data(), batchValues.data(), count);
+
+                    for (int j=0; j<count; ++j) {
+                        BSDFQueryRecord &sRec = scalarRecs[j];
+                        sRec = bRec;
+                        Color3f result = scalarValues[j] = bsdf->sample(sRec, samples[j]);
+                        mismatches += !matches(result, batchValues[j]);
+
+                        if ((result.array() == 0).all())
+                            continue;
+
+                        const BSDFQueryRecord &batchRec = batchRecs[j];
+                        mismatches += sRec.measure != batchRec.measure
+                            || !((sRec.wo - batchRec.wo).array().abs() <= 1e-4f).all();
+
+                        int cosThetaBin = std::min(std::max(0, (int) std::floor((sRec.wo.z()*0.5f+0.5f)
+                                * m_cosThetaResolution)), m_cosThetaResolution-1);
+
+                        float scaledPhi = std::atan2(sRec.wo.y(), sRec.wo.x()) * INV_TWOPI;
+                        if (scaledPhi < 0)
+                            scaledPhi += 1;
+
+                        int phiBin = std::min(std::max(0,
+                            (int) std::floor(scaledPhi * m_phiResolution)), m_phiResolution-1);
+                        obsFrequencies[cosThetaBin * m_phiResolution + phiBin] += 1;
+                    }
 
-                    int phiBin = std::min(std::max(0,
-                        (int) std::floor(scaledPhi * m_phiResolution)), m_phiResolution-1);
-                    obsFrequencies[cosThetaBin * m_phiResolution + phiBin] += 1;
+                    /* Evaluate the BSDF and density of the sampled directions
+                       using both interfaces (the records of failed samples
+                       may not have an outgoing direction) */
+                    bsdf->evalBatch(scalarRecs.data(), batchValues.data(), count);
+                    bsdf->pdfBatch(scalarRecs.data(), batchPdfs.data(), count);
+                    for (int j=0; j<count; ++j) {
+                        if ((scalarValues[j].array() == 0).all())
+                            continue;
+                        mismatches += !matches(bsdf->eval(scalarRecs[j]), batchValues[j]);
+                        mismatches += !matches(Color3f(bsdf->pdf(scalarRecs[j])), Color3f(batchPdfs[j]));
+                    }
                 }
                 cout << "done." << endl;
 
+                /* A few mismatches can be caused by samples that lie right at
+                   the boundary between two components of the BSDF */
+                bool batchConsistent = mismatches <= 1e-4 * m_sampleCount;
+                cout << "Comparing with the batched implementation: " << mismatches
+                     << " mismatches (" << (batchConsistent ? "passed" : "failed") << ")." << endl;
+
                 /* Numerically integrate the probability density
                    function over rectangles in spherical coordinates. */
                 double *ptr = expFrequencies.get();
@@ -184,7 +225,7 @@ public:
                     hypothesis::chi2_test(m_cosThetaResolution*m_phiResolution, obsFrequencies.get(), expFrequencies.get(),
                         m_sampleCount, m_minExpFrequency, m_significanceLevel, m_testCount * (int) m_bsdfs.size());
 
-                if (result.first)
+                if (result.first && batchConsistent)
                     ++passed;
 
                 cout << result.second << endl;
@@ -214,6 +255,14 @@ public:
 
     EClassType getClassType() const { return ETest; }
 private:
+    /// Number of samples that are drawn at once using the batched interface
+    enum { BATCH_SIZE = 1024 };
+
+    /// Do the results of the scalar and batched BSDF interfaces agree?
+    static bool matches(const Color3f &scalar, const Color3f &batch) {
+        return ((scalar - batch).abs() <= 1e-3f * scalar.abs().max(batch.abs()).max(1.0f)).all();
+    }
+
     int m_cosThetaResolution;
     int m_phiResolution;
     int m_minExpFrequency;
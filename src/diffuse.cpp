@@ -82,6 +82,55 @@ public:
         return m_albedo;
     }
 
+    /// Vectorized version of \ref sample()
+    void sampleBatch(BSDFQueryRecord *bRecs, const Point2f *samples,
+                     Color3f *values, size_t count) const {
+        BSDFQueryPacket packet;
+        for (size_t i=0; i<count; i += NORI_BSDF_PACKET_SIZE) {
+            packet.loadIncident(bRecs + i, samples + i, count - i);
+            BSDFQueryPacket::squareToCosineHemisphere(
+                packet.sample[0], packet.sample[1], packet.wo);
+
+            for (size_t k=0; k<packet.size; ++k) {
+                BSDFQueryRecord &bRec = bRecs[i + k];
+                if (packet.wi[2][k] <= 0) {
+                    values[i + k] = Color3f(0.0f);
+                    continue;
+                }
+                bRec.wo = Vector3f(packet.wo[0][k], packet.wo[1][k], packet.wo[2][k]);
+                bRec.measure = ESolidAngle;
+                bRec.eta = 1.0f;
+                values[i + k] = m_albedo;
+            }
+        }
+    }
+
+    /// Vectorized version of \ref eval()
+    void evalBatch(const BSDFQueryRecord *bRecs, Color3f *values, size_t count) const {
+        BSDFQueryPacket packet;
+        for (size_t i=0; i<count; i += NORI_BSDF_PACKET_SIZE) {
+            packet.load(bRecs + i, count - i);
+            BSDFQueryPacket::BoolP valid = packet.solidAngle
+                && packet.wi[2] > 0.0f && packet.wo[2] > 0.0f;
+            for (size_t k=0; k<packet.size; ++k)
+                values[i + k] = valid[k] ? Color3f(m_albedo * INV_PI) : Color3f(0.0f);
+        }
+    }
+
+    /// Vectorized version of \ref pdf()
+    void pdfBatch(const BSDFQueryRecord *bRecs, float *pdfs, size_t count) const {
+        BSDFQueryPacket packet;
+        for (size_t i=0; i<count; i += NORI_BSDF_PACKET_SIZE) {
+            packet.load(bRecs + i, count - i);
+            BSDFQueryPacket::BoolP valid = packet.solidAngle
+                && packet.wi[2] > 0.0f && packet.wo[2] > 0.0f;
+            BSDFQueryPacket::FloatP pdf = valid.select(
+                packet.wo[2] * INV_PI, BSDFQueryPacket::FloatP::Zero());
+            for (size_t k=0; k<packet.size; ++k)
+                pdfs[i + k] = pdf[k];
+        }
+    }
+
     bool isDiffuse() const {
         return true;
     }
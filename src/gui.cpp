@@ -4,11 +4,13 @@
 #include <nanogui/label.h>
 #include <nanogui/slider.h>
 #include <nanogui/layout.h>
+#include <half.h>
 
 NORI_NAMESPACE_BEGIN
 
-NoriScreen::NoriScreen(const ImageBlock &block)
- : nanogui::Screen(block.getSize() + Vector2i(0, 36), "Nori", false), m_block(block) {
+NoriScreen::NoriScreen(const ImageBlock &block, float refreshRate, bool halfFloat)
+ : nanogui::Screen(block.getSize() + Vector2i(0, 36), "Nori", false), m_block(block),
+   m_refreshInterval(refreshRate > 0 ? 1000.f / refreshRate : 0.f), m_halfFloat(halfFloat) {
     using namespace nanogui;
 
     /* Add some UI elements to adjust the exposure value */
@@ -81,29 +83,98 @@ NoriScreen::NoriScreen(const ImageBlock &block)
     glBindTexture(GL_TEXTURE_2D, m_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    const Vector2i &size = block.getSize();
+    glTexImage2D(GL_TEXTURE_2D, 0, halfFloat ? GL_RGBA16F : GL_RGBA32F, size.x(), size.y(),
+            0, GL_RGBA, GL_FLOAT, nullptr);
+
+    /* Later on, only the changed tiles are uploaded through this buffer */
+    glGenBuffers(1, &m_buffer);
+    ImageBlock::Region region;
+    region.offset = Point2i(0, 0);
+    region.size = size;
+    m_block.takeDirtyRegions(m_regions);
+    upload(std::vector<ImageBlock::Region>(1, region));
 
     drawAll();
     setVisible(true);
 }
 
 NoriScreen::~NoriScreen() {
+    glDeleteBuffers(1, &m_buffer);
     glDeleteTextures(1, &m_texture);
     delete m_shader;
 }
 
+void NoriScreen::upload(const std::vector<ImageBlock::Region> &regions) {
+    size_t pixels = 0;
+    for (const ImageBlock::Region &region : regions)
+        pixels += (size_t) region.size.prod();
+    if (pixels == 0)
+        return;
+
+    size_t pixelSize = m_halfFloat ? 4 * sizeof(half) : sizeof(Color4f);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_buffer);
+
+    /* Orphan the previous contents of the buffer, so that the driver
+       does not have to wait until the last transfer has finished */
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, pixels * pixelSize, nullptr, GL_STREAM_DRAW);
+    uint8_t *ptr = (uint8_t *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+        pixels * pixelSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+    if (ptr) {
+        /* Copy the regions back to back. The snapshots only hold each
+           row lock of the image block for a moment */
+        size_t offset = 0;
+        for (const ImageBlock::Region &region : regions) {
+            size_t count = (size_t) region.size.prod();
+            if (!m_halfFloat) {
+                m_block.snapshot(region, reinterpret_cast<Color4f *>(ptr + offset));
+            } else {
+                /* Normalize first, as the accumulated weights could exceed
+                   the range of half precision values */
+                m_staging.resize(count);
+                m_block.snapshot(region, m_staging.data());
+                half *target = reinterpret_cast<half *>(ptr + offset);
+                for (size_t i=0; i<count; ++i) {
+                    const Color4f &c = m_staging[i];
+                    Color3f value = c.w() != 0 ? c.divideByFilterWeight() : Color3f(0.f);
+                    target[4*i+0] = value.r();
+                    target[4*i+1] = value.g();
+                    target[4*i+2] = value.b();
+                    target[4*i+3] = 1.f;
+                }
+            }
+            offset += count * pixelSize;
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        /* With a bound unpack buffer, the data pointers are buffer offsets */
+        offset = 0;
+        for (const ImageBlock::Region &region : regions) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, region.offset.x(), region.offset.y(),
+                region.size.x(), region.size.y(), GL_RGBA,
+                m_halfFloat ? GL_HALF_FLOAT : GL_FLOAT, (const void *) offset);
+            offset += (size_t) region.size.prod() * pixelSize;
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 void NoriScreen::drawContents() {
-    /* Reload the partially rendered image onto the GPU */
-    m_block.lock();
-    int borderSize = m_block.getBorderSize();
+    /* Upload the parts of the image that changed since the last refresh,
+       at most at the configured rate */
+    if (m_refreshTimer.elapsed() >= m_refreshInterval) {
+        m_refreshTimer.reset();
+        m_block.takeDirtyRegions(m_regions);
+        upload(m_regions);
+    }
+
     const Vector2i &size = m_block.getSize();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texture);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) m_block.cols());
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(),
-            0, GL_RGBA, GL_FLOAT, (uint8_t *) m_block.data() +
-            (borderSize * m_block.cols() + borderSize) * sizeof(Color4f));
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-    m_block.unlock();
 
     glViewport(0, GLsizei(36 * mPixelRatio), GLsizei(mPixelRatio*size[0]),
          GLsizei(mPixelRatio*size[1]));
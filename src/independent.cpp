@@ -22,6 +22,61 @@
 
 NORI_NAMESPACE_BEGIN
 
+/// Convert a state of the pcg32 generator into its next floating point output
+static inline float pcg32Float(uint64_t state) {
+    uint32_t xorshifted = (uint32_t) (((state >> 18u) ^ state) >> 27u);
+    uint32_t rot = (uint32_t) (state >> 59u);
+    union { uint32_t u; float f; } x;
+    x.u = (((xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31))) >> 9) | 0x3f800000u;
+    return x.f - 1.0f;
+}
+
+/**
+ * \brief Fill \c out with the next \c n floats of \c rng
+ *
+ * The stream is split into interleaved lanes: lane \c k produces elements
+ * <tt>k, k+LANES, k+2*LANES, ..</tt> by advancing its own copy of the
+ * generator state by \c LANES steps at a time. The output is identical to
+ * \c n calls of <tt>pcg32::nextFloat()</tt>.
+ *
+ * This is plain scalar code: the lanes only break up the serial dependency
+ * on a single state, so that the processor can overlap their 64-bit
+ * multiplications. It is not vectorized, since AVX and AVX2 lack a 64-bit
+ * integer multiplication.
+ */
+static void pcg32Fill(pcg32 &rng, float *out, size_t n) {
+    enum { LANES = 8 };
+
+    if (n < LANES) {
+        for (size_t i=0; i<n; ++i)
+            out[i] = rng.nextFloat();
+        return;
+    }
+
+    /* Multiplier and increment that advance the state by LANES steps */
+    uint64_t mult = 1u, plus = 0u, state[LANES];
+    for (int k=0; k<LANES; ++k) {
+        state[k] = k == 0 ? rng.state : state[k-1] * PCG32_MULT + rng.inc;
+        mult *= PCG32_MULT;
+        plus = plus * PCG32_MULT + rng.inc;
+    }
+
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (int k=0; k<LANES; ++k) {
+            out[i + k] = pcg32Float(state[k]);
+            state[k] = state[k] * mult + plus;
+        }
+    }
+
+    size_t remainder = n - i;
+    for (size_t k=0; k<remainder; ++k)
+        out[i + k] = pcg32Float(state[k]);
+
+    /* Lane 'remainder' holds the state after exactly n steps */
+    rng.state = state[remainder];
+}
+
 /**
  * Independent sampling - returns independent uniformly distributed
  * random numbers on <tt>[0, 1)x[0, 1)</tt>.
@@ -45,9 +100,9 @@ public:
         return std::move(cloned);
     }
 
-    void prepare(const ImageBlock &block) {
+    void prepare(const ImageBlock &block, size_t firstSample) {
         m_random.seed(
-            block.getOffset().x(),
+            ((uint64_t) firstSample << 32) | (uint32_t) block.getOffset().x(),
             block.getOffset().y()
         );
     }
@@ -66,6 +121,16 @@ public:
         );
     }
 
+    void nextND(float *out, size_t n) {
+        pcg32Fill(m_random, out, n);
+    }
+
+    void nextBatch(const Point2i *, size_t count, size_t, uint32_t dimension, float *out) {
+        /* The pixel and sample index don't matter here, hence
+           the entire batch comes from one contiguous stream */
+        pcg32Fill(m_random, out, count * dimension);
+    }
+
     std::string toString() const {
         return tfm::format("Independent[sampleCount=%i]", m_sampleCount);
     }
@@ -0,0 +1,448 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lightbvh.h>
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+void LightBounds::expandBy(const LightBounds &bounds) {
+    if (!bounds.isValid())
+        return;
+    if (!isValid()) {
+        *this = bounds;
+        return;
+    }
+    bbox.expandBy(bounds.bbox);
+    power += bounds.power;
+
+    /* Find the smallest cone that contains both normal cones */
+    Vector3f axis1 = axis, axis2 = bounds.axis;
+    float theta1 = theta, theta2 = bounds.theta;
+    if (theta1 < theta2) {
+        std::swap(axis1, axis2);
+        std::swap(theta1, theta2);
+    }
+
+    float thetaD = std::acos(clamp(axis1.dot(axis2), -1.0f, 1.0f));
+    if (std::min(thetaD + theta2, M_PI) <= theta1) {
+        /* The wider cone already contains the other one */
+        axis = axis1;
+        theta = theta1;
+        return;
+    }
+
+    float thetaO = 0.5f * (theta1 + thetaD + theta2);
+    if (thetaO >= M_PI) {
+        axis = axis1;
+        theta = M_PI;
+        return;
+    }
+
+    /* Rotate the axis of the wider cone towards the other one */
+    Vector3f rotationAxis = axis1.cross(axis2);
+    if (rotationAxis.squaredNorm() < 1e-12f) {
+        Vector3f unused;
+        coordinateSystem(axis1, rotationAxis, unused);
+    }
+    axis = Eigen::AngleAxisf(thetaO - theta1, rotationAxis.normalized()) * axis1;
+    axis.normalize();
+    theta = thetaO;
+}
+
+float LightBounds::importance(const Point3f &ref) const {
+    if (!isValid() || power <= 0)
+        return 0.0f;
+
+    /* Bounding sphere of the triangles, and the squared distance to it
+       (clamped to its radius to avoid the singularity at the center) */
+    Point3f center = bbox.getCenter();
+    Vector3f d = ref - center;
+    float distSquared = d.squaredNorm();
+    float radiusSquared = (bbox.max - center).squaredNorm();
+    if (distSquared <= radiusSquared)
+        return power / std::max(radiusSquared, Epsilon * Epsilon);
+
+    /* Smallest angle between the direction towards 'ref' from any point
+       in the sphere and any normal in the cone */
+    float dist = std::sqrt(distSquared);
+    float thetaR = std::acos(clamp(axis.dot(d) / dist, -1.0f, 1.0f));
+    float thetaU = std::asin(std::sqrt(radiusSquared / distSquared));
+    float thetaP = std::max(0.0f, thetaR - theta - thetaU);
+
+    /* Area emitters only emit into the hemisphere around their normal */
+    if (thetaP >= 0.5f * M_PI)
+        return 0.0f;
+
+    return power * std::cos(thetaP) / distSquared;
+}
+
+float LightBounds::getOrientationMeasure() const {
+    /* Solid angle of the emitted directions, weighted by the cosine
+       falloff of diffuse emission beyond the normal cone */
+    float thetaW = std::min(theta + 0.5f * M_PI, M_PI);
+    float sinTheta = std::sin(theta), cosTheta = std::cos(theta);
+    return 2.0f * M_PI * (1.0f - cosTheta) + 0.5f * M_PI *
+        (2.0f * thetaW * sinTheta - std::cos(theta - 2.0f * thetaW)
+         - 2.0f * theta * sinTheta + cosTheta);
+}
+
+std::string LightBounds::toString() const {
+    if (!isValid())
+        return "LightBounds[invalid]";
+    return tfm::format(
+        "LightBounds[bbox=%s, axis=%s, theta=%f, power=%f]",
+        bbox.toString(), axis.toString(), theta, power);
+}
+
+/* Bin data structure for accumulating the bounds of emissive triangles along all three axes */
+struct LightBins {
+    static const int BIN_COUNT = 12;
+    LightBins() { memset(counts, 0, sizeof(uint32_t) * 3 * BIN_COUNT); }
+    uint32_t counts[3][BIN_COUNT];
+    LightBounds bounds[3][BIN_COUNT];
+};
+
+/**
+ * \brief Parallel top-down construction of a \ref LightBVH
+ *
+ * Like the SAH build of \ref Accel, every node is split by binning the
+ * centroids of its triangles, and large nodes are binned in parallel and
+ * build their subtrees concurrently. The split cost is the surface area
+ * orientation heuristic (SAOH) by Conty Estevez and Kulla, which weights
+ * the surface area of each child by its power and orientation bounds.
+ */
+class LightBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Build subtrees serially when less than 4K triangles are left
+        SERIAL_THRESHOLD = 4096,
+
+        /// Process triangles in batches of 1K for the purpose of parallelization
+        GRAIN_SIZE = 1000
+    };
+
+    LightBVHBuilder(LightBVH &bvh, const std::vector<LightBounds> &bounds,
+                    const std::vector<Point3f> &centroids)
+        : bvh(bvh), bounds(bounds), centroids(centroids) { }
+
+    /// Build the subtree with root \c node_idx over the triangles <tt>[start, end)</tt>
+    void build(uint32_t node_idx, uint32_t parent, uint32_t *start, uint32_t *end) {
+        uint32_t size = (uint32_t) (end - start);
+        LightBVH::LightBVHNode &node = bvh.m_nodes[node_idx];
+        node.parent = parent;
+
+        if (size == 1) {
+            node.leaf = true;
+            node.child = *start;
+            node.bounds = bounds[*start];
+            bvh.m_leaves[*start] = node_idx;
+            return;
+        }
+
+        /* Bounding box of the triangle centroids */
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(centroids[start[i]]);
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        Vector3f extents = centroidBounds.getExtents();
+        float maxExtent = extents.maxCoeff();
+        auto binIndex = [&](uint32_t f, int axis) {
+            float value = (centroids[f][axis] - centroidBounds.min[axis])
+                * (LightBins::BIN_COUNT / extents[axis]);
+            return std::min(std::max((int) value, 0), LightBins::BIN_COUNT - 1);
+        };
+
+        int best_axis = -1, best_index = -1;
+        if (maxExtent > 0) {
+            /* Accumulate all triangles into bins along each axis */
+            LightBins bins = tbb::parallel_reduce(
+                tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+                LightBins(),
+                [&](const tbb::blocked_range<uint32_t> &range, LightBins result) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        uint32_t f = start[i];
+                        for (int axis = 0; axis < 3; ++axis) {
+                            if (extents[axis] <= 0)
+                                continue;
+                            int index = binIndex(f, axis);
+                            result.counts[axis][index]++;
+                            result.bounds[axis][index].expandBy(bounds[f]);
+                        }
+                    }
+                    return result;
+                },
+                [](const LightBins &b1, const LightBins &b2) {
+                    LightBins result;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        for (int i = 0; i < LightBins::BIN_COUNT; ++i) {
+                            result.counts[axis][i] = b1.counts[axis][i] + b2.counts[axis][i];
+                            result.bounds[axis][i] = LightBounds::merge(b1.bounds[axis][i], b2.bounds[axis][i]);
+                        }
+                    }
+                    return result;
+                }
+            );
+
+            /* Choose the split plane with the lowest SAOH cost. Thin axes
+               are penalized to favor nodes with a regular shape. */
+            float best_cost = std::numeric_limits<float>::infinity();
+            for (int axis = 0; axis < 3; ++axis) {
+                if (extents[axis] <= 0)
+                    continue;
+                float regularization = maxExtent / extents[axis];
+
+                LightBounds left[LightBins::BIN_COUNT];
+                uint32_t count_left[LightBins::BIN_COUNT];
+                left[0] = bins.bounds[axis][0];
+                count_left[0] = bins.counts[axis][0];
+                for (int i = 1; i < LightBins::BIN_COUNT; ++i) {
+                    left[i] = LightBounds::merge(left[i-1], bins.bounds[axis][i]);
+                    count_left[i] = count_left[i-1] + bins.counts[axis][i];
+                }
+
+                LightBounds right;
+                for (int i = LightBins::BIN_COUNT - 2; i >= 0; --i) {
+                    right.expandBy(bins.bounds[axis][i+1]);
+                    if (count_left[i] == 0 || count_left[i] == size)
+                        continue;
+                    float saoh_cost = regularization * (cost(left[i]) + cost(right));
+                    if (saoh_cost < best_cost) {
+                        best_cost = saoh_cost;
+                        best_axis = axis;
+                        best_index = i;
+                    }
+                }
+            }
+        }
+
+        uint32_t *middle;
+        if (best_axis >= 0) {
+            middle = std::partition(start, end, [&](uint32_t f) {
+                return binIndex(f, best_axis) <= best_index;
+            });
+        } else {
+            /* All centroids coincide -- split the triangles in half */
+            middle = start + size / 2;
+        }
+
+        uint32_t left_count = (uint32_t) (middle - start);
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.leaf = false;
+        node.child = node_idx_right;
+
+        if (size < SERIAL_THRESHOLD) {
+            build(node_idx_left, node_idx, start, middle);
+            build(node_idx_right, node_idx, middle, end);
+        } else {
+            tbb::parallel_invoke(
+                [&] { build(node_idx_left, node_idx, start, middle); },
+                [&] { build(node_idx_right, node_idx, middle, end); }
+            );
+        }
+
+        node.bounds = LightBounds::merge(bvh.m_nodes[node_idx_left].bounds,
+                                         bvh.m_nodes[node_idx_right].bounds);
+    }
+
+private:
+    /// Cost of a child in the SAOH (up to a constant factor shared by all splits of a node)
+    static float cost(const LightBounds &bounds) {
+        return bounds.power * bounds.bbox.getSurfaceArea() * bounds.getOrientationMeasure();
+    }
+
+    LightBVH &bvh;
+    const std::vector<LightBounds> &bounds;
+    const std::vector<Point3f> &centroids;
+};
+
+void LightBVH::build(const std::vector<Mesh *> &meshes) {
+    m_nodes.clear();
+    m_triangles.clear();
+    m_leaves.clear();
+    m_meshOffset.clear();
+
+    for (const Mesh *mesh : meshes) {
+        if (!mesh->isEmitter())
+            continue;
+        m_meshOffset[mesh] = (uint32_t) m_triangles.size();
+        for (uint32_t i = 0; i < mesh->getTriangleCount(); ++i)
+            m_triangles.push_back(std::make_pair(mesh, i));
+    }
+
+    uint32_t size = (uint32_t) m_triangles.size();
+    if (size == 0)
+        return;
+
+    cout << "Constructing a light BVH (" << size << " emissive triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Bounds of every emissive triangle */
+    std::vector<LightBounds> bounds(size);
+    std::vector<Point3f> centroids(size);
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, size, LightBVHBuilder::GRAIN_SIZE),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                const Mesh *mesh = m_triangles[i].first;
+                uint32_t index = m_triangles[i].second;
+                const MatrixXfMap &V = mesh->getVertexPositions();
+                const MatrixXfMap &N = mesh->getVertexNormals();
+                const MatrixXuMap &F = mesh->getIndices();
+
+                LightBounds &b = bounds[i];
+                if (N.size() > 0) {
+                    /* Emission uses the interpolated normals, which
+                       lie within the cone of the vertex normals */
+                    for (int k = 0; k < 3; ++k) {
+                        LightBounds vertex;
+                        vertex.axis = Vector3f(N.col(F(k, index))).normalized();
+                        vertex.theta = 0.0f;
+                        b.expandBy(vertex);
+                    }
+                } else {
+                    const Point3f p0 = V.col(F(0, index)), p1 = V.col(F(1, index)),
+                                  p2 = V.col(F(2, index));
+                    b.axis = (p1 - p0).cross(p2 - p0).normalized();
+                    b.theta = 0.0f;
+                }
+                if (!std::isfinite(b.axis.squaredNorm()) || !std::isfinite(b.theta)) {
+                    /* Degenerate triangle */
+                    b.axis = Vector3f(0.0f, 0.0f, 1.0f);
+                    b.theta = M_PI;
+                }
+                b.bbox = mesh->getBoundingBox(index);
+                b.power = mesh->surfaceArea(index) *
+                    mesh->getEmitter()->getRadiance().getLuminance();
+                centroids[i] = mesh->getCentroid(index);
+            }
+        }
+    );
+
+    /* A tree with single-triangle leaves has exactly 2N-1 nodes */
+    m_nodes.resize(2 * size - 1);
+    m_leaves.resize(size);
+    std::vector<uint32_t> indices(size);
+    for (uint32_t i = 0; i < size; ++i)
+        indices[i] = i;
+
+    LightBVHBuilder(*this, bounds, centroids).build(
+        0u, (uint32_t) -1, indices.data(), indices.data() + size);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(LightBVHNode) * m_nodes.size() + sizeof(uint32_t) * m_leaves.size())
+        << ")." << endl;
+}
+
+float LightBVH::childProbability(const Point3f &ref, uint32_t parent, uint32_t child) const {
+    const LightBVHNode &node = m_nodes[parent];
+    float importanceLeft = m_nodes[parent + 1].bounds.importance(ref),
+          importanceRight = m_nodes[node.child].bounds.importance(ref),
+          total = importanceLeft + importanceRight;
+    if (total <= 0)
+        return 0.0f;
+    return (child == node.child ? importanceRight : importanceLeft) / total;
+}
+
+Color3f LightBVH::sample(EmitterQueryRecord &lRec, float selection, const Point2f &sample) const {
+    if (m_nodes.empty())
+        return Color3f(0.0f);
+
+    /* Descend from the root, rescaling the selection sample at every level */
+    uint32_t node_idx = 0;
+    float prob = 1.0f;
+    while (!m_nodes[node_idx].leaf) {
+        const LightBVHNode &node = m_nodes[node_idx];
+        float importanceLeft = m_nodes[node_idx + 1].bounds.importance(lRec.ref),
+              importanceRight = m_nodes[node.child].bounds.importance(lRec.ref),
+              total = importanceLeft + importanceRight;
+        if (total <= 0)
+            return Color3f(0.0f);
+        float probLeft = importanceLeft / total, probRight = importanceRight / total;
+
+        if (selection < probLeft) {
+            selection = selection / probLeft;
+            prob *= probLeft;
+            node_idx = node_idx + 1;
+        } else {
+            selection = std::min((selection - probLeft) / probRight,
+                                 1.0f - std::numeric_limits<float>::epsilon());
+            prob *= probRight;
+            node_idx = node.child;
+        }
+    }
+
+    const std::pair<const Mesh *, uint32_t> &triangle = m_triangles[m_nodes[node_idx].child];
+    Point3f p;
+    Normal3f n;
+    triangle.first->sampleTriangle(triangle.second, sample, p, n);
+    lRec.emitter = triangle.first->getEmitter();
+    lRec.triangle = triangle.second;
+    lRec.setPosition(p, n);
+    lRec.pdf = lRec.toSolidAngle(prob / triangle.first->surfaceArea(triangle.second));
+    if (lRec.pdf == 0)
+        return Color3f(0.0f);
+    return lRec.emitter->eval(lRec) / lRec.pdf;
+}
+
+float LightBVH::pdf(const EmitterQueryRecord &lRec) const {
+    if (!lRec.emitter || m_nodes.empty())
+        return 0.0f;
+
+    const Mesh *mesh = lRec.emitter->getMesh();
+    auto it = m_meshOffset.find(mesh);
+    if (it == m_meshOffset.end() || lRec.triangle >= mesh->getTriangleCount())
+        return 0.0f;
+
+    /* Ascend from the leaf of the triangle to the root */
+    uint32_t node_idx = m_leaves[it->second + lRec.triangle];
+    float prob = 1.0f;
+    while (m_nodes[node_idx].parent != (uint32_t) -1) {
+        uint32_t parent = m_nodes[node_idx].parent;
+        prob *= childProbability(lRec.ref, parent, node_idx);
+        if (prob == 0)
+            return 0.0f;
+        node_idx = parent;
+    }
+
+    return lRec.toSolidAngle(prob / mesh->surfaceArea(lRec.triangle));
+}
+
+std::string LightBVH::toString() const {
+    return tfm::format(
+        "LightBVH[triangles=%i, nodes=%i, bounds=%s]",
+        m_triangles.size(), m_nodes.size(),
+        m_nodes.empty() ? std::string("none") : m_nodes[0].bounds.toString());
+}
+
+NORI_NAMESPACE_END
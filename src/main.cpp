@@ -25,14 +25,35 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/tiledoutput.h>
+#include <nori/wavefront.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <filesystem/resolver.h>
+#include <pugixml.hpp>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <csignal>
 
 using namespace nori;
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/**
+ * \brief Render \c sampleCount samples in each pixel of an image block
+ *
+ * With adaptive sampling enabled in the scene, pixels stop receiving
+ * samples once the standard error of their mean luminance falls below
+ * the configured fraction of the mean. The number of samples taken in
+ * each pixel is then written to \c sampleCounts (when given).
+ *
+ * \return The total number of samples taken
+ */
+static size_t renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                          uint32_t sampleCount, ImageBlock *sampleCounts = nullptr) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
@@ -42,116 +63,465 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
-    /* For each pixel and pixel sample sample */
+    float threshold = scene->getAdaptiveThreshold();
+    uint32_t minSamples = threshold > 0
+        ? std::min(scene->getAdaptiveMinSamples(), sampleCount) : sampleCount;
+    size_t total = 0;
+
+    /* Camera rays are generated and traced one row of pixels at a time */
+    Ray3f rays[NORI_BLOCK_SIZE];
+    HitRecord hits[NORI_BLOCK_SIZE];
+    Point2f pixelSamples[NORI_BLOCK_SIZE];
+    Color3f weights[NORI_BLOCK_SIZE];
+    Point2i pixels[NORI_BLOCK_SIZE];
+    float cameraSamples[4 * NORI_BLOCK_SIZE];
+
+    /* Columns of the pixels that still need samples, and running
+       luminance moments of each pixel (Welford's algorithm) */
+    int active[NORI_BLOCK_SIZE];
+    uint32_t samples[NORI_BLOCK_SIZE], valid[NORI_BLOCK_SIZE];
+    float mean[NORI_BLOCK_SIZE], m2[NORI_BLOCK_SIZE];
+
+    /* For each row, pixel sample and pixel */
     for (int y=0; y<size.y(); ++y) {
+        int activeCount = size.x();
         for (int x=0; x<size.x(); ++x) {
-            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-                Point2f apertureSample = sampler->next2D();
+            active[x] = x;
+            samples[x] = valid[x] = 0;
+            mean[x] = m2[x] = 0.f;
+        }
+
+        for (uint32_t i=0; i<sampleCount && activeCount > 0; ++i) {
+            /* Generate the pixel and aperture samples of the entire row at once */
+            for (int j=0; j<activeCount; ++j)
+                pixels[j] = Point2i(active[j] + offset.x(), y + offset.y());
+            sampler->nextBatch(pixels, (size_t) activeCount, i, 4, cameraSamples);
+
+            for (int j=0; j<activeCount; ++j) {
+                const float *sample = cameraSamples + 4 * j;
+                pixelSamples[j] = Point2f(pixels[j].cast<float>()) + Point2f(sample[0], sample[1]);
+                Point2f apertureSample(sample[2], sample[3]);
 
                 /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+                weights[j] = camera->sampleRay(rays[j], pixelSamples[j], apertureSample);
+            }
 
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
+            /* Find the first intersection of all rays in the row */
+            scene->rayIntersect(rays, hits, (size_t) activeCount);
+            total += (size_t) activeCount;
+
+            int remaining = 0;
+            for (int j=0; j<activeCount; ++j) {
+                int x = active[j];
+
+                /* Compute the incident radiance (the camera ray
+                   used the first four dimensions of the sample) */
+                sampler->setSample(pixels[j], i, 4);
+                Color3f value = weights[j] * integrator->LiPrimary(scene, sampler, rays[j], hits[j]);
 
                 /* Store in the image block */
-                block.put(pixelSample, value);
+                block.put(pixelSamples[j], value);
+                samples[x] = i + 1;
+
+                if (minSamples == sampleCount) {
+                    active[remaining++] = x;
+                    continue;
+                }
+
+                if (value.isValid()) {
+                    float lum = value.getLuminance(), delta = lum - mean[x];
+                    mean[x] += delta / ++valid[x];
+                    m2[x] += delta * (lum - mean[x]);
+                }
+
+                /* Keep sampling until the estimated error is small enough */
+                bool converged = i + 1 >= minSamples && valid[x] > 1 &&
+                    std::sqrt(m2[x] / ((valid[x] - 1) * (float) valid[x]))
+                        <= threshold * std::max(mean[x], 1e-3f);
+                if (!converged)
+                    active[remaining++] = x;
             }
+            activeCount = remaining;
+        }
+
+        if (sampleCounts) {
+            for (int x=0; x<size.x(); ++x)
+                sampleCounts->coeffRef(y, x) = Color4f(Color3f((float) samples[x]));
         }
     }
+
+    return total;
 }
 
-static void render(Scene *scene, const std::string &filename) {
+/**
+ * \brief Resources of a thread that renders image blocks
+ *
+ * TBB hands out a single block per task, so these are kept per thread
+ * (rather than per task) and reused for all blocks of all passes.
+ */
+struct RenderThreadState {
+    /// Image block that is rendered by the thread
+    ImageBlock block;
+    /// Number of samples per pixel of the block (with adaptive sampling)
+    std::unique_ptr<ImageBlock> counts;
+    /// Clone of the scene's sampler
+    std::unique_ptr<Sampler> sampler;
+    /// Queue of paths in flight (in wavefront mode)
+    std::unique_ptr<WavefrontRenderer> wavefront;
+
+    RenderThreadState(const Scene *scene, bool adaptive)
+        : block(Vector2i(NORI_BLOCK_SIZE), scene->getCamera()->getReconstructionFilter()),
+          sampler(scene->getSampler()->clone()) {
+        if (adaptive)
+            counts.reset(new ImageBlock(Vector2i(NORI_BLOCK_SIZE), nullptr));
+        if (scene->isWavefront())
+            wavefront.reset(new WavefrontRenderer(scene, scene->getWavefrontQueueSize()));
+    }
+};
+
+/// Set when the process is asked to terminate during a progressive render
+static volatile std::sig_atomic_t terminationRequested = 0;
+
+/**
+ * \brief Identify a render by hashing the parts of its scene description
+ * that affect the image (FNV-1a)
+ *
+ * The sample count and the settings of the progressive mode are left out,
+ * so that raising them resumes the render from its checkpoint instead of
+ * discarding it. Formatting and comments of the file do not matter either,
+ * while the meshes add the identity of the files they load.
+ */
+static uint64_t sceneKey(const Scene *scene, const std::string &filename) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto hashString = [&](const char *str) {
+        do {
+            hash = (hash ^ (uint8_t) *str) * 0x100000001b3ULL;
+        } while (*str++ != '\0');
+    };
+
+    std::function<void(const pugi::xml_node &)> hashNode = [&](const pugi::xml_node &node) {
+        if (node.type() != pugi::node_element)
+            return;
+        std::string parent = node.parent().name(), name = node.attribute("name").value();
+        if ((parent == "sampler" && name == "sampleCount") ||
+            (parent == "scene" && (name == "passSamples" || name == "timeBudget" ||
+                                   name == "checkpointInterval")))
+            return;
+
+        hashString(node.name());
+        for (const pugi::xml_attribute &attr : node.attributes()) {
+            hashString(attr.name());
+            hashString(attr.value());
+        }
+        for (const pugi::xml_node &child : node.children())
+            hashNode(child);
+    };
+
+    pugi::xml_document doc;
+    if (doc.load_file(filename.c_str()))
+        hashNode(doc.document_element());
+
+    for (const Mesh *mesh : scene->getMeshes())
+        hashString(mesh->getSourceID().c_str());
+
+    return hash;
+}
+
+static void render(Scene *scene, const std::string &filename, bool headless) {
     const Camera *camera = scene->getCamera();
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+    /* Determine the base name of the output files */
+    std::string outputName = filename;
+    size_t lastdot = outputName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        outputName.erase(lastdot, std::string::npos);
 
-    /* Allocate memory for the entire output image and clear it */
-    ImageBlock result(outputSize, camera->getReconstructionFilter());
-    result.clear();
+    /* Create a block generator (i.e. a work scheduler) */
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE, scene->getBlockOrder());
+
+    /* With adaptive sampling, also record the number of samples per pixel */
+    bool adaptive = scene->getAdaptiveThreshold() > 0;
+
+    /* Allocate memory for the entire output image and clear it. With tiled
+       output, the image is instead written to disk piece by piece */
+    std::unique_ptr<ImageBlock> result, sampleCounts;
+    std::unique_ptr<TiledImageOutput> tiledResult, tiledSampleCounts;
+    if (scene->isTiledOutput()) {
+        if (!headless) {
+            cout << "Tiled output: rendering without a preview window." << endl;
+            headless = true;
+        }
+        tiledResult.reset(new TiledImageOutput(outputName + ".exr", outputSize,
+            camera->getReconstructionFilter(), scene->getExrCompression(), scene->isExrHalf()));
+        if (adaptive)
+            tiledSampleCounts.reset(new TiledImageOutput(outputName + "_spp.exr",
+                outputSize, nullptr, scene->getExrCompression(), scene->isExrHalf()));
+    } else {
+        result.reset(new ImageBlock(outputSize, camera->getReconstructionFilter()));
+        result->clear();
+        if (adaptive) {
+            sampleCounts.reset(new ImageBlock(outputSize, nullptr));
+            sampleCounts->clear();
+        }
+    }
+    std::atomic<size_t> totalSamples(0);
+
+    /* In progressive mode, the image is rendered in several passes over
+       all blocks. An interrupted render resumes from its last checkpoint */
+    uint32_t sampleCount = (uint32_t) scene->getSampler()->getSampleCount();
+    uint32_t passSamples = scene->getPassSamples();
+    bool progressive = passSamples > 0;
+    bool checkpoints = progressive && scene->getCheckpointInterval() > 0;
+    std::string checkpointName = outputName + ".nchk";
+    uint64_t key = sceneKey(scene, filename);
+    uint32_t samplesDone = 0;
+
+    if (progressive) {
+        if (checkpoints)
+            samplesDone = std::min(result->loadCheckpoint(checkpointName, key), sampleCount);
+
+        /* Finish the current pass and save a checkpoint when terminated */
+        std::signal(SIGTERM, [](int) { terminationRequested = 1; });
+    } else {
+        passSamples = sampleCount;
+    }
 
-    /* Create a window that visualizes the partially rendered result */
-    nanogui::init();
-    NoriScreen *screen = new NoriScreen(result);
+    /* Per-thread resources, which are created on first use */
+    tbb::enumerable_thread_specific<std::unique_ptr<RenderThreadState>> threadStates;
 
-    /* Do the following in parallel and asynchronously */
-    std::thread render_thread([&] {
-        cout << "Rendering .. ";
-        cout.flush();
-        Timer timer;
+    /* Render a pass over all blocks in parallel */
+    auto renderPass = [&](uint32_t firstSample, uint32_t samples) {
+        int blockCount = blockGenerator.getBlockCount();
+        tbb::blocked_range<int> range(0, blockCount, 1);
+        std::atomic<int> blocksDone(0);
+        std::mutex progressMutex;
 
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+        blockGenerator.reset();
 
         auto map = [&](const tbb::blocked_range<int> &range) {
-            /* Allocate memory for a small image block to be rendered
-               by the current thread */
-            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                camera->getReconstructionFilter());
-
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            /* Fetch the image block, sampler, and (in wavefront
+               mode) queue of paths of the current thread */
+            std::unique_ptr<RenderThreadState> &state = threadStates.local();
+            if (!state)
+                state.reset(new RenderThreadState(scene, adaptive));
+            ImageBlock &block = state->block;
+            ImageBlock *counts = state->counts.get();
+            Sampler *sampler = state->sampler.get();
+            WavefrontRenderer *wavefront = state->wavefront.get();
 
             for (int i=range.begin(); i<range.end(); ++i) {
                 /* Request an image block from the block generator */
-                blockGenerator.next(block);
+                if (!blockGenerator.next(block))
+                    break;
 
                 /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
+                sampler->prepare(block, firstSample);
 
                 /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
+                if (counts) {
+                    counts->setOffset(block.getOffset());
+                    counts->setSize(block.getSize());
+                    counts->clear();
+                }
+                if (wavefront)
+                    totalSamples += wavefront->render(sampler, block, samples);
+                else
+                    totalSamples += renderBlock(scene, sampler, block, samples, counts);
 
                 /* The image block has been processed. Now add it to
                    the "big" block that represents the entire image */
-                result.put(block);
+                if (tiledResult) {
+                    tiledResult->put(block);
+                    if (counts)
+                        tiledSampleCounts->put(*counts);
+                } else {
+                    result->put(block);
+                    if (counts)
+                        sampleCounts->put(*counts);
+                }
+
+                /* Without a preview window, report progress in steps of 10% */
+                if (headless && !progressive) {
+                    int done = ++blocksDone;
+                    if (done * 10 / blockCount > (done - 1) * 10 / blockCount) {
+                        std::lock_guard<std::mutex> lock(progressMutex);
+                        cout << (done * 10 / blockCount) * 10 << "% .. ";
+                        cout.flush();
+                    }
+                }
             }
         };
 
         /// Uncomment the following line for single threaded rendering
         // map(range);
 
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
+        /// Default: parallel rendering. Blocks are handed out one at a time,
+        /// so that idle threads steal work rather than wait on a batch
+        tbb::parallel_for(range, map, tbb::simple_partitioner());
+    };
+
+    auto renderImage = [&] {
+        Timer timer, checkpointTimer;
+        uint32_t samplesSaved = samplesDone;
+
+        while (samplesDone < sampleCount) {
+            if (progressive && scene->getTimeBudget() > 0 &&
+                timer.elapsed() >= 1000.0 * scene->getTimeBudget()) {
+                cout << "Time budget exhausted after " << samplesDone
+                     << " samples per pixel." << endl;
+                break;
+            }
+            if (terminationRequested) {
+                cout << "Terminated after " << samplesDone
+                     << " samples per pixel." << endl;
+                break;
+            }
+
+            uint32_t samples = std::min(passSamples, sampleCount - samplesDone);
+            if (progressive)
+                cout << "Rendering samples " << samplesDone + 1 << "-"
+                     << samplesDone + samples << " of " << sampleCount << " .. ";
+            else
+                cout << "Rendering .. ";
+            cout.flush();
+            Timer passTimer;
+
+            renderPass(samplesDone, samples);
+            samplesDone += samples;
+
+            cout << "done. (took " << passTimer.elapsedString() << ")" << endl;
+
+            if (checkpoints && samplesDone < sampleCount &&
+                checkpointTimer.elapsed() >= 1000.0 * scene->getCheckpointInterval()) {
+                result->saveCheckpoint(checkpointName, key, samplesDone);
+                samplesSaved = samplesDone;
+                checkpointTimer.reset();
+            }
+        }
+
+        /* Keep the final state, which allows adding samples later on */
+        if (checkpoints && samplesDone != samplesSaved)
+            result->saveCheckpoint(checkpointName, key, samplesDone);
 
-        cout << "done. (took " << timer.elapsedString() << ")" << endl;
-    });
+        if (progressive)
+            cout << "Rendering took " << timer.elapsedString() << "." << endl;
+
+        if (ImageBlock::getInvalidSampleCount() > 0)
+            cerr << "Warning: discarded " << ImageBlock::getInvalidSampleCount()
+                 << " invalid radiance values." << endl;
+
+        if (adaptive) {
+            size_t pixels = (size_t) outputSize.prod();
+            size_t budget = pixels * sampleCount;
+            cout << tfm::format("Adaptive sampling: %.1f samples per pixel on average "
+                "(%.1f%% of the budget).", totalSamples / (double) pixels,
+                100.0 * totalSamples / (double) budget) << endl;
+        }
+    };
+
+    if (headless) {
+        renderImage();
+    } else {
+        /* Create a window that visualizes the partially rendered result */
+        nanogui::init();
+        NoriScreen *screen = new NoriScreen(*result,
+            scene->getPreviewRate(), scene->isPreviewHalf());
+
+        /* Do the following in parallel and asynchronously. Errors are
+           passed on to the main thread, and close the window */
+        std::exception_ptr renderError;
+        std::thread render_thread([&] {
+            try {
+                renderImage();
+            } catch (...) {
+                renderError = std::current_exception();
+                nanogui::leave();
+            }
+        });
 
-    /* Enter the application main loop */
-    nanogui::mainloop();
+        /* Enter the application main loop */
+        nanogui::mainloop();
 
-    /* Shut down the user interface */
-    render_thread.join();
+        /* Shut down the user interface */
+        render_thread.join();
 
-    delete screen;
-    nanogui::shutdown();
+        delete screen;
+        nanogui::shutdown();
+
+        if (renderError)
+            std::rethrow_exception(renderError);
+    }
+
+    /* The tiled output files only need to be completed */
+    if (tiledResult) {
+        tiledResult->close();
+        if (tiledSampleCounts)
+            tiledSampleCounts->close();
+        return;
+    }
 
     /* Now turn the rendered image block into
        a properly normalized bitmap */
-    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
-
-    /* Determine the filename of the output bitmap */
-    std::string outputName = filename;
-    size_t lastdot = outputName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        outputName.erase(lastdot, std::string::npos);
-    outputName += ".exr";
+    std::unique_ptr<Bitmap> bitmap(result->toBitmap());
 
     /* Save using the OpenEXR format */
-    bitmap->save(outputName);
+    bitmap->save(outputName + ".exr", scene->getExrCompression(), scene->isExrHalf());
+
+    /* Save the number of samples taken in each pixel */
+    if (sampleCounts) {
+        std::unique_ptr<Bitmap> heatmap(sampleCounts->toBitmap());
+        heatmap->save(outputName + "_spp.exr", scene->getExrCompression(), scene->isExrHalf());
+    }
+}
+
+/// Convert a Wavefront OBJ mesh into Nori's binary mesh format
+static void convertMesh(const std::string &input, std::string output) {
+    if (output.empty()) {
+        output = input;
+        size_t lastdot = output.find_last_of(".");
+        if (lastdot != std::string::npos)
+            output.erase(lastdot, std::string::npos);
+        output += ".nbm";
+    }
+
+    PropertyList propList;
+    propList.setString("filename", input);
+    std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+        NoriObjectFactory::createInstance("obj", propList)));
+    mesh->load();
+    mesh->writeBinary(output);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    /* Render without a preview window (also available as a scene property) */
+    bool headless = false;
+    auto it = std::find(args.begin(), args.end(), "--headless");
+    if (it != args.end()) {
+        headless = true;
+        args.erase(it);
+    }
+
+    if (args.size() >= 2 && args.size() <= 3 && args[0] == "--convert") {
+        try {
+            convertMesh(args[1], args.size() == 3 ? args[2] : "");
+        } catch (const std::exception &e) {
+            cerr << "Fatal error: " << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (args.size() != 1) {
+        cerr << "Syntax: " << argv[0] << " [--headless] <scene.xml>" << endl;
+        cerr << "        " << argv[0] << " --convert <mesh.obj> [mesh.nbm]" << endl;
         return -1;
     }
 
-    filesystem::path path(argv[1]);
+    filesystem::path path(args[0]);
 
     try {
         if (path.extension() == "xml") {
@@ -160,14 +530,16 @@ int main(int argc, char **argv) {
                resources (OBJ files, textures) using relative paths */
             getFileResolver()->prepend(path.parent_path());
 
-            std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+            std::unique_ptr<NoriObject> root(loadFromXML(args[0]));
 
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), argv[1]);
-        } else if (path.extension() == "exr") {
+            if (root->getClassType() == NoriObject::EScene) {
+                Scene *scene = static_cast<Scene *>(root.get());
+                render(scene, args[0], headless || scene->isHeadless());
+            }
+        } else if (path.extension() == "exr" && !headless) {
             /* Alternatively, provide a basic OpenEXR image viewer */
-            Bitmap bitmap(argv[1]);
+            Bitmap bitmap(args[0]);
             ImageBlock block(Vector2i((int) bitmap.cols(), (int) bitmap.rows()), nullptr);
             block.fromBitmap(bitmap);
             nanogui::init();
@@ -176,8 +548,9 @@ int main(int argc, char **argv) {
             delete screen;
             nanogui::shutdown();
         } else {
-            cerr << "Fatal error: unknown file \"" << argv[1]
-                 << "\", expected an extension of type .xml or .exr" << endl;
+            cerr << "Fatal error: unknown file \"" << args[0]
+                 << "\", expected an extension of type .xml" << (headless ? "" : " or .exr") << endl;
+            return -1;
         }
     } catch (const std::exception &e) {
         cerr << "Fatal error: " << e.what() << endl;
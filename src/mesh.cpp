@@ -22,40 +22,102 @@
 #include <nori/emitter.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <sys/stat.h>
 
 NORI_NAMESPACE_BEGIN
 
-Mesh::Mesh() { }
+Mesh::Mesh() : m_V(nullptr, 0, 0), m_N(nullptr, 0, 0),
+    m_UV(nullptr, 0, 0), m_F(nullptr, 0, 0) { }
 
 Mesh::~Mesh() {
     delete m_bsdf;
     delete m_emitter;
 }
 
+void Mesh::setBuffers(const float *V, const float *N, const float *UV,
+                      const uint32_t *F, uint32_t vertexCount, uint32_t triangleCount) {
+    /* Eigen maps cannot be reassigned, but they can be re-constructed in place */
+    new (&m_V) MatrixXfMap(V, 3, vertexCount);
+    new (&m_N) MatrixXfMap(N, 3, N ? vertexCount : 0);
+    new (&m_UV) MatrixXfMap(UV, 2, UV ? vertexCount : 0);
+    new (&m_F) MatrixXuMap(F, 3, triangleCount);
+}
+
+std::string Mesh::getFileID(const std::string &filename) {
+#if defined(PLATFORM_WINDOWS)
+    struct _stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0)
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+#endif
+        throw NoriException("Unable to access \"%s\"!", filename);
+    return tfm::format("%s:%llu:%lld", filename,
+        (unsigned long long) st.st_size, (long long) st.st_mtime);
+}
+
 void Mesh::activate() {
     if (!m_bsdf) {
         /* If no material was assigned, instantiate a diffuse BRDF */
         m_bsdf = static_cast<BSDF *>(
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
+}
+
+void Mesh::load() {
+    if (m_loaded)
+        return;
+    loadBuffers();
+    finishLoading();
+}
+
+void Mesh::restore(const float *V, const float *N, const float *UV,
+                   const uint32_t *F, uint32_t vertexCount, uint32_t triangleCount,
+                   const BoundingBox3f &bbox) {
+    if (m_loaded)
+        throw NoriException("Mesh::restore(): the mesh was already loaded!");
+    setBuffers(V, N, UV, F, vertexCount, triangleCount);
+    m_bbox = bbox;
+    finishLoading();
+}
 
-    // 根据三角形面积大小建立discrete probability distribution
-    for(uint32_t i = 0; i < getTriangleCount(); ++i) dpdf.append(surfaceArea(i));
+void Mesh::finishLoading() {
+    m_loaded = true;
+
+    /* Discrete distribution over the triangles, proportional to their
+       surface area (used by samplePosition()) */
+    m_dpdf.clear();
+    m_dpdf.reserve(getTriangleCount());
+    for (uint32_t i = 0; i < getTriangleCount(); ++i)
+        m_dpdf.append(surfaceArea(i));
+    m_dpdf.normalize();
 }
 
-void Mesh::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const
-{
-    float eta1 = sample.x();
-    float eta2 = sample.y();
-    int index = dpdf.sample(eta1);
+uint32_t Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const {
+    /* Select a triangle, and reuse the first sample dimension to
+       choose the position within it */
+    Point2f sample(_sample);
+    uint32_t index = (uint32_t) m_dpdf.sampleReuse(sample.x());
+    sampleTriangle(index, sample, p, n);
+    return index;
+}
 
+void Mesh::sampleTriangle(uint32_t index, const Point2f &sample, Point3f &p, Normal3f &n) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
-    float alpha = 1.0f-sqrtf(1.0f-eta1);
-    float beta = eta2*sqrtf(1.0f-eta1);
-    p = alpha*p0+beta*p1+(1.0f-alpha-beta)*p2;
-    n = Vector3f((p1 - p0).cross(p2 - p0)).norm();
+    /* Uniformly distributed barycentric coordinates */
+    float alpha = 1.0f - std::sqrt(1.0f - sample.x());
+    float beta = sample.y() * std::sqrt(1.0f - sample.x());
+    p = alpha * p0 + beta * p1 + (1.0f - alpha - beta) * p2;
+
+    if (m_N.size() > 0) {
+        /* Interpolate the vertex normals, like the intersection code */
+        n = (alpha * m_N.col(i0) + beta * m_N.col(i1) +
+            (1.0f - alpha - beta) * m_N.col(i2)).normalized();
+    } else {
+        n = (p1 - p0).cross(p2 - p0).normalized();
+    }
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
@@ -134,6 +196,7 @@ void Mesh::addChild(NoriObject *obj) {
                     throw NoriException(
                         "Mesh: tried to register multiple Emitter instances!");
                 m_emitter = emitter;
+                m_emitter->setMesh(this);
             }
             break;
 
@@ -54,6 +54,41 @@ public:
         return Color3f(1.0f);
     }
 
+    /// Vectorized version of \ref sample()
+    void sampleBatch(BSDFQueryRecord *bRecs, const Point2f *samples,
+                     Color3f *values, size_t count) const {
+        BSDFQueryPacket packet;
+        for (size_t i=0; i<count; i += NORI_BSDF_PACKET_SIZE) {
+            packet.loadIncident(bRecs + i, samples + i, count - i);
+            BSDFQueryPacket::BoolP valid = packet.wi[2] > 0.0f;
+
+            // Reflection in local coordinates
+            packet.wo[0] = -packet.wi[0];
+            packet.wo[1] = -packet.wi[1];
+            packet.wo[2] =  packet.wi[2];
+
+            for (size_t k=0; k<packet.size; ++k) {
+                BSDFQueryRecord &bRec = bRecs[i + k];
+                if (!valid[k]) {
+                    values[i + k] = Color3f(0.0f);
+                    continue;
+                }
+                bRec.wo = Vector3f(packet.wo[0][k], packet.wo[1][k], packet.wo[2][k]);
+                bRec.measure = EDiscrete;
+                bRec.eta = 1.0f;
+                values[i + k] = Color3f(1.0f);
+            }
+        }
+    }
+
+    void evalBatch(const BSDFQueryRecord *, Color3f *values, size_t count) const {
+        std::fill(values, values + count, Color3f(0.0f));
+    }
+
+    void pdfBatch(const BSDFQueryRecord *, float *pdfs, size_t count) const {
+        std::fill(pdfs, pdfs + count, 0.0f);
+    }
+
     std::string toString() const {
         return "Mirror[]";
     }
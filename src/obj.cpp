@@ -16,159 +16,414 @@
     along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <cfloat>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into chunks at line boundaries,
+ * which are parsed in parallel without any per-line memory allocations.
+ * Every chunk deduplicates its face vertices in a local table; the tables
+ * are then merged in file order, so that the result is identical to that
+ * of a sequential parser.
  */
 class WavefrontOBJ : public Mesh {
 public:
+    /// Approximate size of the chunks that are parsed in parallel
+    enum { CHUNK_SIZE = 1 << 20 };
+
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+        m_name = getFileResolver()->resolve(propList.getString("filename")).str();
+        m_trafo = propList.getTransform("toWorld", Transform());
+
+        /* The file is only parsed by loadBuffers(), but it must exist */
+        try {
+            m_fileID = getFileID(m_name);
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open OBJ file \"%s\"!", m_name);
+        }
+    }
+
+    std::string getSourceID() const {
+        std::string id = "obj:" + m_fileID;
+        for (int i = 0; i < 16; ++i)
+            id += tfm::format(":%.9g", m_trafo.getMatrix()(i / 4, i % 4));
+        return id;
+    }
 
-        filesystem::path filename =
-            getFileResolver()->resolve(propList.getString("filename"));
+protected:
+    void loadBuffers() {
+        const std::string &filename = m_name;
+        const Transform &trafo = m_trafo;
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename));
+        } catch (const NoriException &) {
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
-        Transform trafo = propList.getTransform("toWorld", Transform());
+        }
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
+        /* Split the file into chunks that end at line boundaries */
+        const char *data = (const char *) file->data(), *end = data + file->size();
+        std::vector<const char *> bounds(1, data);
+        while (bounds.back() < end) {
+            const char *next = bounds.back() + std::min((size_t) CHUNK_SIZE, (size_t) (end - bounds.back()));
+            if (next < end) {
+                next = (const char *) memchr(next, '\n', end - next);
+                next = next ? next + 1 : end;
+            }
+            bounds.push_back(next);
+        }
+
+        std::vector<OBJChunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            chunks[i].parse(bounds[i], bounds[i + 1], trafo);
+        });
+
+        /* Concatenate the attributes and merge the vertex tables in file order */
+        std::vector<Vector3f> positions, normals;
+        std::vector<Vector2f> texcoords;
+        std::vector<size_t> indexOffset(chunks.size() + 1, 0);
+        std::vector<std::vector<uint32_t>> remap(chunks.size());
+        OBJVertexTable vertexTable;
+
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const OBJChunk &chunk = chunks[i];
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            m_bbox.expandBy(chunk.bbox);
+
+            remap[i].resize(chunk.vertices.vertices.size());
+            for (size_t j = 0; j < chunk.vertices.vertices.size(); ++j)
+                remap[i][j] = vertexTable.insert(chunk.vertices.vertices[j]);
+            indexOffset[i + 1] = indexOffset[i] + chunk.indices.size();
+        }
+
+        const std::vector<OBJVertex> &vertices = vertexTable.vertices;
+        uint32_t vertexCount = (uint32_t) vertices.size();
+
+        m_indices.resize(3, indexOffset.back() / 3);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            uint32_t *target = m_indices.data() + indexOffset[i];
+            for (uint32_t index : chunks[i].indices)
+                *target++ = remap[i][index];
+        });
+
+        /* Look up an attribute referenced by a (1-based) OBJ index */
+        auto lookup = [&](const auto &values, uint32_t index) -> decltype(values[0]) {
+            if (index == 0 || index > values.size())
+                throw NoriException("Invalid vertex data in OBJ file \"%s\"", filename);
+            return values[index - 1];
+        };
+
+        m_positions.resize(3, vertexCount);
+        if (!normals.empty())
+            m_normals.resize(3, vertexCount);
+        if (!texcoords.empty())
+            m_texcoords.resize(2, vertexCount);
+
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, vertexCount, 4096),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_positions.col(i) = lookup(positions, vertices[i].p);
+                    if (!normals.empty())
+                        m_normals.col(i) = lookup(normals, vertices[i].n);
+                    if (!texcoords.empty())
+                        m_texcoords.col(i) = lookup(texcoords, vertices[i].uv);
+                }
+            }
+        );
 
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+        setBuffers(m_positions.data(),
+                   m_normals.size() > 0 ? m_normals.data() : nullptr,
+                   m_texcoords.size() > 0 ? m_texcoords.data() : nullptr,
+                   m_indices.data(), (uint32_t) m_positions.cols(),
+                   (uint32_t) m_indices.cols());
 
-            std::string prefix;
-            line >> prefix;
+        double seconds = timer.elapsed() / 1000.0;
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << ", " << tfm::format("%.1f", seconds > 0 ? file->size() / (seconds * 1e6) : 0.0)
+             << " MB/s)" << endl;
+    }
+
+    /// Vertex indices used by the OBJ format
+    struct OBJVertex {
+        uint32_t p = (uint32_t) -1;
+        uint32_t n = (uint32_t) -1;
+        uint32_t uv = (uint32_t) -1;
+
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
+
+    /**
+     * \brief Open-addressing hash table that assigns consecutive
+     * indices to distinct OBJ vertices in order of first insertion
+     */
+    struct OBJVertexTable {
+        std::vector<OBJVertex> vertices; ///< Distinct vertices
+        std::vector<uint32_t> slots;     ///< 1 + index into \c vertices, or 0 if unused
+
+        uint32_t insert(const OBJVertex &v) {
+            if (2 * (vertices.size() + 1) > slots.size())
+                rehash(std::max((size_t) 1024, 2 * slots.size()));
+
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash(v) & mask; ; i = (i + 1) & mask) {
+                uint32_t slot = slots[i];
+                if (slot == 0) {
+                    vertices.push_back(v);
+                    slots[i] = (uint32_t) vertices.size();
+                    return slots[i] - 1;
+                } else if (vertices[slot - 1] == v) {
+                    return slot - 1;
+                }
+            }
+        }
 
-            if (prefix == "v") {
+        void rehash(size_t size) {
+            slots.assign(size, 0u);
+            for (uint32_t j = 0; j < (uint32_t) vertices.size(); ++j) {
+                size_t i = hash(vertices[j]) & (size - 1);
+                while (slots[i] != 0)
+                    i = (i + 1) & (size - 1);
+                slots[i] = j + 1;
+            }
+        }
+
+        static size_t hash(const OBJVertex &v) {
+            uint64_t h = v.p * 0x9E3779B97F4A7C15ULL;
+            h ^= (h >> 29) + v.uv * 0xBF58476D1CE4E5B9ULL;
+            h ^= (h >> 32) + v.n * 0x94D049BB133111EBULL;
+            return (size_t) (h ^ (h >> 31));
+        }
+    };
+
+    /// Geometry parsed from a range of lines of the OBJ file
+    struct OBJChunk {
+        std::vector<Vector3f> positions;
+        std::vector<Vector2f> texcoords;
+        std::vector<Vector3f> normals;
+        std::vector<uint32_t> indices;   ///< Indices into \c vertices
+        OBJVertexTable vertices;
+        BoundingBox3f bbox;
+
+        void parse(const char *ptr, const char *end, const Transform &trafo) {
+            while (ptr < end) {
+                const char *eol = (const char *) memchr(ptr, '\n', end - ptr);
+                if (!eol)
+                    eol = end;
+                parseLine(ptr, eol, trafo);
+                ptr = eol + 1;
+            }
+        }
+
+        void parseLine(const char *ptr, const char *end, const Transform &trafo) {
+            ptr = skipSpace(ptr, end);
+            const char *prefix = ptr;
+            while (ptr < end && !isSpace(*ptr))
+                ++ptr;
+            size_t length = ptr - prefix;
+
+            if (length == 1 && prefix[0] == 'v') {
                 Point3f p;
-                line >> p.x() >> p.y() >> p.z();
+                ptr = parseFloat(ptr, end, p.x());
+                ptr = parseFloat(ptr, end, p.y());
+                ptr = parseFloat(ptr, end, p.z());
                 p = trafo * p;
-                m_bbox.expandBy(p);
+                bbox.expandBy(p);
                 positions.push_back(p);
-            } else if (prefix == "vt") {
+            } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 't') {
                 Point2f tc;
-                line >> tc.x() >> tc.y();
+                ptr = parseFloat(ptr, end, tc.x());
+                ptr = parseFloat(ptr, end, tc.y());
                 texcoords.push_back(tc);
-            } else if (prefix == "vn") {
+            } else if (length == 2 && prefix[0] == 'v' && prefix[1] == 'n') {
                 Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
+                ptr = parseFloat(ptr, end, n.x());
+                ptr = parseFloat(ptr, end, n.y());
+                ptr = parseFloat(ptr, end, n.z());
                 normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
+            } else if (length == 1 && prefix[0] == 'f') {
                 OBJVertex verts[6];
-                int nVertices = 3;
+                int nVertices = 0;
+                while (nVertices < 4) {
+                    ptr = skipSpace(ptr, end);
+                    if (ptr == end)
+                        break;
+                    ptr = parseVertex(ptr, end, verts[nVertices++]);
+                }
 
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
+                if (nVertices < 3)
+                    throw NoriException("Invalid face data: \"%s\"", std::string(prefix, end));
 
-                if (!v4.empty()) {
+                if (nVertices == 4) {
                     /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
                     verts[4] = verts[0];
                     verts[5] = verts[2];
                     nVertices = 6;
                 }
+
                 /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+                for (int i=0; i<nVertices; ++i)
+                    indices.push_back(vertices.insert(verts[i]));
             }
         }
+    };
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+    /// Is \c c a character that separates the tokens of a line?
+    static inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+    static inline const char *skipSpace(const char *ptr, const char *end) {
+        while (ptr < end && isSpace(*ptr))
+            ++ptr;
+        return ptr;
+    }
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+    /// Parse a vertex reference of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+    static const char *parseVertex(const char *ptr, const char *end, OBJVertex &v) {
+        const char *start = ptr;
+        uint32_t *fields[3] = { &v.p, &v.uv, &v.n };
+
+        for (int i = 0; i < 3; ++i) {
+            if (ptr < end && *ptr >= '0' && *ptr <= '9') {
+                uint32_t value = 0;
+                while (ptr < end && *ptr >= '0' && *ptr <= '9')
+                    value = value * 10 + (uint32_t) (*ptr++ - '0');
+                *fields[i] = value;
+            } else if (i == 0) {
+                break;
+            }
+
+            if (i < 2 && ptr < end && *ptr == '/')
+                ++ptr;
+            else
+                break;
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+        if (ptr == start || (ptr < end && !isSpace(*ptr))) {
+            while (ptr < end && !isSpace(*ptr))
+                ++ptr;
+            throw NoriException("Invalid vertex data: \"%s\"", std::string(start, ptr));
         }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        return ptr;
     }
 
-protected:
-    /// Vertex indices used by the OBJ format
-    struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+    /**
+     * \brief Parse a floating point value
+     *
+     * Handles the common case of short decimal numbers with exactly rounded
+     * double precision arithmetic, and defers to \c strtof() whenever that
+     * could produce a different result (many digits, large exponents,
+     * ties, denormals, or unusual syntax).
+     */
+    static const char *parseFloat(const char *ptr, const char *end, float &result) {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        ptr = skipSpace(ptr, end);
+        const char *start = ptr;
 
-        inline OBJVertex() { }
+        bool negative = false;
+        if (ptr < end && (*ptr == '-' || *ptr == '+'))
+            negative = *ptr++ == '-';
+
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool valid = false;
+        while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+            mantissa = mantissa * 10 + (uint64_t) (*ptr++ - '0');
+            digits += mantissa != 0;
+            valid = true;
+            if (digits > 15)
+                return parseFloatFallback(start, end, result);
+        }
+        if (ptr < end && *ptr == '.') {
+            ++ptr;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+                mantissa = mantissa * 10 + (uint64_t) (*ptr++ - '0');
+                digits += mantissa != 0;
+                exponent--;
+                valid = true;
+                if (digits > 15)
+                    return parseFloatFallback(start, end, result);
+            }
+        }
+        if (valid && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+            ++ptr;
+            bool negativeExp = false;
+            if (ptr < end && (*ptr == '-' || *ptr == '+'))
+                negativeExp = *ptr++ == '-';
+            if (ptr == end || *ptr < '0' || *ptr > '9')
+                return parseFloatFallback(start, end, result);
+            int value = 0;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9' && value < 10000)
+                value = value * 10 + (*ptr++ - '0');
+            exponent += negativeExp ? -value : value;
+        }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        if (!valid || (ptr < end && !isSpace(*ptr)) || exponent < -22 || exponent > 22)
+            return parseFloatFallback(start, end, result);
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        double value = (double) mantissa;
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
 
-            p = toUInt(tokens[0]);
+        /* The conversion to single precision rounds a second time. This can
+           only differ from a correctly rounded result when 'value' lies
+           exactly halfway between two floats, or outside the normal range */
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(double));
+        if ((value != 0 && (value < FLT_MIN || value > FLT_MAX)) ||
+            (bits & ((1ull << 29) - 1)) == (1ull << 28))
+            return parseFloatFallback(start, end, result);
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        result = negative ? -(float) value : (float) value;
+        return ptr;
+    }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+    /// Parse a floating point value using \c strtof()
+    static const char *parseFloatFallback(const char *ptr, const char *end, float &result) {
+        char buf[128];
+        size_t length = 0;
+        while (ptr + length < end && !isSpace(ptr[length]) && length < sizeof(buf) - 1) {
+            buf[length] = ptr[length];
+            ++length;
         }
+        buf[length] = '\0';
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
-        }
-    };
+        char *end_ptr = nullptr;
+        result = strtof(buf, &end_ptr);
+        return ptr + (end_ptr - buf);
+    }
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
-        }
-    };
+    MatrixXf m_positions;   ///< Storage of the vertex positions
+    MatrixXf m_normals;     ///< Storage of the vertex normals
+    MatrixXf m_texcoords;   ///< Storage of the vertex texture coordinates
+    MatrixXu m_indices;     ///< Storage of the faces
+    Transform m_trafo;      ///< Transformation that is applied to the vertices
+    std::string m_fileID;   ///< Identifier of the file (see \ref getFileID())
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,262 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <nori/lightbvh.h>
+#include <nori/sampler.h>
+#include <nori/wavefront.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Unidirectional path tracer with multiple importance sampling
+ *
+ * At every non-specular vertex, the direct illumination is estimated
+ * twice: by sampling a position on an emitter (next event estimation),
+ * and by sampling the BSDF, which also continues the path. The two
+ * estimates are combined with the power heuristic. Paths are terminated
+ * with Russian roulette based on their throughput.
+ *
+ * Emitters are chosen either in proportion to their power (using the
+ * emitter table of the scene), or by traversing a \ref LightBVH, which
+ * also accounts for their distance and orientation and works much better
+ * in scenes with many lights.
+ *
+ * The integrator supports wavefront rendering, where the vertices of
+ * many paths are shaded in batches (see \ref WavefrontRenderer).
+ */
+class PathMISIntegrator : public Integrator {
+public:
+    PathMISIntegrator(const PropertyList &propList) {
+        /* Maximum number of bounces (-1: only Russian roulette ends a path) */
+        m_maxDepth = propList.getInteger("maxDepth", -1);
+
+        /* Number of bounces before Russian roulette starts */
+        m_rrDepth = propList.getInteger("rrDepth", 3);
+
+        /* Strategy for choosing emitters (power or bvh) */
+        std::string lightSelection = propList.getString("lightSelection", "power");
+        if (lightSelection == "power")
+            m_lightSelection = EPowerSelection;
+        else if (lightSelection == "bvh")
+            m_lightSelection = EBVHSelection;
+        else
+            throw NoriException("PathMISIntegrator: unknown light selection \"%s\" "
+                "(must be power or bvh)!", lightSelection);
+    }
+
+    void preprocess(const Scene *scene) {
+        if (m_lightSelection == EBVHSelection)
+            m_lightBVH.build(scene->getMeshes());
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        HitRecord hit;
+        scene->rayIntersect(ray, hit);
+        return LiPrimary(scene, sampler, ray, hit);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const HitRecord &hit) const {
+        PathState path(ray);
+        path.hit = hit;
+
+        while (path.hit.isValid()) {
+            ShadowRay shadowRay;
+            bool shadow = shadeVertex(scene, sampler, path, shadowRay);
+            if (shadow && !scene->rayIntersect(shadowRay.ray))
+                path.radiance += shadowRay.contribution;
+            if (!path.alive)
+                break;
+
+            path.hit = HitRecord();
+            scene->rayIntersect(path.ray, path.hit);
+        }
+
+        return path.radiance;
+    }
+
+    bool supportsWavefront() const { return true; }
+
+    void shade(const Scene *scene, Sampler *sampler, PathState *paths,
+               size_t count, std::vector<ShadowRay> &shadowRays) const {
+        for (size_t i=0; i<count; ++i) {
+            PathState &path = paths[i];
+
+            /* Every vertex uses a fixed range of sample dimensions */
+            sampler->setSample(path.pixel, path.sampleIndex, path.dimension);
+            path.dimension += DIMENSIONS_PER_VERTEX;
+
+            ShadowRay shadowRay;
+            if (shadeVertex(scene, sampler, path, shadowRay))
+                shadowRays.push_back(shadowRay);
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "PathMISIntegrator[\n"
+            "  maxDepth = %i,\n"
+            "  rrDepth = %i,\n"
+            "  lightSelection = %s\n"
+            "]", m_maxDepth, m_rrDepth,
+            m_lightSelection == EBVHSelection ? "bvh" : "power");
+    }
+
+private:
+    /// Strategies for choosing an emitter in next event estimation
+    enum ELightSelection {
+        /// Proportional to the emitted power (see \ref Scene::sampleEmitter())
+        EPowerSelection = 0,
+        /// Stochastic traversal of a \ref LightBVH
+        EBVHSelection
+    };
+
+    /**
+     * \brief Samples used by \ref shadeVertex() at each vertex of a path
+     *
+     * They are always drawn together and in this order, so that every
+     * vertex consumes the same range of sample dimensions, whether or not
+     * e.g. Russian roulette is applied.
+     */
+    struct VertexSamples {
+        float emitterSelection;     ///< Chooses the emitter triangle (next event estimation)
+        Point2f emitterPosition;    ///< Chooses the position on that triangle
+        Point2f bsdf;               ///< Samples the BSDF for the next ray
+        float roulette;             ///< Decides whether the path survives Russian roulette
+
+        /// Number of 1D and 2D samples drawn above
+        enum { SAMPLE_COUNT = 4 };
+
+        VertexSamples(Sampler *sampler)
+            : emitterSelection(sampler->next1D()), emitterPosition(sampler->next2D()),
+              bsdf(sampler->next2D()), roulette(sampler->next1D()) { }
+    };
+
+    /// Number of sample dimensions used by \ref shadeVertex() (with two per 1D/2D sample)
+    enum { DIMENSIONS_PER_VERTEX = 2 * VertexSamples::SAMPLE_COUNT };
+
+    /**
+     * \brief Shade the vertex \c path.hit of a path
+     *
+     * Adds the emission at the vertex to \c path.radiance, and samples the
+     * BSDF to find the next ray of the path (or terminates it). Returns
+     * \c true when next event estimation produced a shadow ray, whose
+     * contribution must be added if it is unoccluded.
+     */
+    bool shadeVertex(const Scene *scene, Sampler *sampler, PathState &path,
+                     ShadowRay &shadowRay) const {
+        Intersection its;
+        scene->computeSurfaceInteraction(path.hit, its);
+        path.alive = false;
+
+        /* Emission that is visible directly or was hit by sampling the BSDF */
+        if (its.mesh->isEmitter()) {
+            EmitterQueryRecord lRec(its.mesh->getEmitter(), its.idx, path.ray.o, its.p, its.shFrame.n);
+            Color3f radiance = lRec.emitter->eval(lRec);
+            if (!radiance.isZero()) {
+                float weight = path.specular ? 1.0f :
+                    powerHeuristic(path.bsdfPdf, pdfEmitter(scene, lRec));
+                path.radiance += path.throughput * radiance * weight;
+            }
+        }
+
+        if (m_maxDepth >= 0 && (int) path.depth >= m_maxDepth)
+            return false;
+
+        const BSDF *bsdf = its.mesh->getBSDF();
+        Vector3f wi = its.toLocal(-path.ray.d);
+        VertexSamples samples(sampler);
+        bool shadow = false;
+
+        /* Next event estimation: sample a position on an emitter */
+        EmitterQueryRecord lRec(its.p);
+        Color3f radiance = sampleEmitter(scene, lRec, samples.emitterSelection,
+                                         samples.emitterPosition);
+        if (!radiance.isZero()) {
+            BSDFQueryRecord bRec(wi, its.toLocal(lRec.wi), ESolidAngle);
+            Color3f value = bsdf->eval(bRec);
+
+            if (!value.isZero()) {
+                float weight = powerHeuristic(lRec.pdf, bsdf->pdf(bRec));
+                shadowRay.ray = lRec.shadowRay;
+                shadowRay.contribution = path.throughput * value * radiance *
+                    std::abs(Frame::cosTheta(bRec.wo)) * weight;
+                shadowRay.path = &path;
+                shadow = true;
+            }
+        }
+
+        /* Sample the BSDF to find the next vertex of the path */
+        BSDFQueryRecord bRec(wi);
+        Color3f weight = bsdf->sample(bRec, samples.bsdf);
+        if (weight.isZero())
+            return shadow;
+
+        path.specular = bRec.measure == EDiscrete;
+        path.bsdfPdf = path.specular ? 0.0f : bsdf->pdf(bRec);
+        path.throughput *= weight;
+
+        /* Russian roulette: continue with a probability that is
+           proportional to the remaining throughput */
+        if ((int) path.depth >= m_rrDepth) {
+            float q = std::min(path.throughput.maxCoeff(), 0.95f);
+            if (samples.roulette >= q)
+                return shadow;
+            path.throughput /= q;
+        }
+
+        path.ray = Ray3f(its.p, its.toWorld(bRec.wo));
+        path.depth++;
+        path.alive = true;
+        return shadow;
+    }
+
+    /// Sample a position on an emitter using the configured strategy
+    Color3f sampleEmitter(const Scene *scene, EmitterQueryRecord &lRec,
+                          float selection, const Point2f &sample) const {
+        if (m_lightSelection == EBVHSelection)
+            return m_lightBVH.sample(lRec, selection, sample);
+        return scene->sampleEmitter(lRec, selection, sample);
+    }
+
+    /// Density of \ref sampleEmitter() with respect to solid angles at \c lRec.ref
+    float pdfEmitter(const Scene *scene, const EmitterQueryRecord &lRec) const {
+        if (m_lightSelection == EBVHSelection)
+            return m_lightBVH.pdf(lRec);
+        return scene->pdfEmitter(lRec);
+    }
+
+    /// Multiple importance sampling weight of the strategy with density \c pdfA
+    static float powerHeuristic(float pdfA, float pdfB) {
+        pdfA *= pdfA;
+        pdfB *= pdfB;
+        return pdfA > 0 ? pdfA / (pdfA + pdfB) : 0.0f;
+    }
+
+    int m_maxDepth;
+    int m_rrDepth;
+    ELightSelection m_lightSelection;
+    LightBVH m_lightBVH;
+};
+
+NORI_REGISTER_CLASS(PathMISIntegrator, "path_mis");
+NORI_NAMESPACE_END
@@ -26,12 +26,107 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &propList) {
 	m_accel = new Accel();
 	//m_accel = new Octree();
+
+    /* Branching factor of the BVH (2: binary, 4/8: collapsed wide BVH) */
+    m_accel->setBranchingFactor(propList.getInteger("bvhWidth", 2));
+
+    /* BVH construction algorithm (sah, lbvh, or hlbvh) */
+    std::string builder = propList.getString("bvhBuilder", "sah");
+    if (builder == "sah")
+        m_accel->setBuildMethod(Accel::ESAHBuild);
+    else if (builder == "lbvh")
+        m_accel->setBuildMethod(Accel::ELBVHBuild);
+    else if (builder == "hlbvh")
+        m_accel->setBuildMethod(Accel::EHLBVHBuild);
+    else
+        throw NoriException("Scene: unknown BVH builder \"%s\" (must be sah, lbvh, or hlbvh)!", builder);
+
+    /* Optional on-disk cache of built trees */
+    std::string cachePolicy = propList.getString("bvhCachePolicy", "readwrite");
+    Accel::ECachePolicy policy;
+    if (cachePolicy == "off")
+        policy = Accel::ECacheOff;
+    else if (cachePolicy == "readonly")
+        policy = Accel::ECacheReadOnly;
+    else if (cachePolicy == "readwrite")
+        policy = Accel::ECacheReadWrite;
+    else if (cachePolicy == "refresh")
+        policy = Accel::ECacheRefresh;
+    else
+        throw NoriException("Scene: unknown BVH cache policy \"%s\" (must be off, "
+            "readonly, readwrite, or refresh)!", cachePolicy);
+    m_accel->setCache(propList.getString("bvhCache", ""), policy);
+
+    /* Render straight to disk without a preview window */
+    m_headless = propList.getBoolean("headless", false);
+
+    /* Order in which image blocks are rendered (spiral or hilbert) */
+    std::string blockOrder = propList.getString("blockOrder", "spiral");
+    if (blockOrder == "spiral")
+        m_blockOrder = BlockGenerator::ESpiral;
+    else if (blockOrder == "hilbert")
+        m_blockOrder = BlockGenerator::EHilbert;
+    else
+        throw NoriException("Scene: unknown block order \"%s\" (must be spiral or hilbert)!", blockOrder);
+
+    /* Adaptive sampling: stop sampling pixels once the standard error of
+       their mean luminance drops below this fraction of the mean */
+    m_adaptiveThreshold = propList.getFloat("adaptiveThreshold", 0.f);
+    int minSamples = propList.getInteger("adaptiveMinSamples", 16);
+    if (m_adaptiveThreshold < 0 || minSamples < 2)
+        throw NoriException("Scene: adaptiveThreshold must be nonnegative and "
+            "adaptiveMinSamples must be at least 2!");
+    m_adaptiveMinSamples = (uint32_t) minSamples;
+
+    /* Progressive rendering: sweep over the image in passes of this many
+       samples per pixel, stop when the time budget runs out, and save
+       checkpoints that allow resuming an interrupted render */
+    int passSamples = propList.getInteger("passSamples", 0);
+    m_timeBudget = propList.getFloat("timeBudget", 0.f);
+    m_checkpointInterval = propList.getFloat("checkpointInterval", 600.f);
+    if (passSamples < 0 || m_timeBudget < 0 || m_checkpointInterval < 0)
+        throw NoriException("Scene: passSamples, timeBudget, and checkpointInterval must be nonnegative!");
+    if (passSamples > 0 && m_adaptiveThreshold > 0)
+        throw NoriException("Scene: adaptive sampling cannot be combined with progressive rendering!");
+    m_passSamples = (uint32_t) passSamples;
+
+    /* Write finished tiles of the image to disk while rendering, so that
+       the full-resolution framebuffer never has to be in memory */
+    m_tiledOutput = propList.getBoolean("tiledOutput", false);
+    if (m_tiledOutput && m_passSamples > 0)
+        throw NoriException("Scene: tiled output cannot be combined with progressive rendering!");
+
+    /* Encoding of the output files (none, zip, piz, or dwaa; half or
+       single precision), trading file size against the time to write them */
+    m_exrCompression = Bitmap::compressionFromString(propList.getString("exrCompression", "zip"));
+    m_exrHalf = propList.getBoolean("exrHalf", false);
+
+    /* Refresh rate of the preview window (0: every frame), and whether
+       it receives half precision pixels to reduce the transfer size */
+    m_previewRate = propList.getFloat("previewRate", 20.f);
+    if (m_previewRate < 0)
+        throw NoriException("Scene: previewRate must be nonnegative!");
+    m_previewHalf = propList.getBoolean("previewHalf", false);
+
+    /* Wavefront rendering: keep this many paths in flight per thread,
+       and advance all of them by one stage at a time */
+    m_wavefront = propList.getBoolean("wavefront", false);
+    int queueSize = propList.getInteger("wavefrontQueueSize", 8192);
+    if (queueSize < NORI_BLOCK_SIZE)
+        throw NoriException("Scene: wavefrontQueueSize must be at least %i!", NORI_BLOCK_SIZE);
+    if (m_wavefront && m_adaptiveThreshold > 0)
+        throw NoriException("Scene: adaptive sampling cannot be combined with wavefront rendering!");
+    m_wavefrontQueueSize = (uint32_t) queueSize;
 }
 
 Scene::~Scene() {
+    /* Emitters that belong to a mesh are released by the mesh */
+    for (Emitter *emitter : m_emitters)
+        if (!emitter->getMesh())
+            delete emitter;
     delete m_accel;
     delete m_sampler;
     delete m_camera;
@@ -45,6 +140,8 @@ void Scene::activate() {
         throw NoriException("No integrator was specified!");
     if (!m_camera)
         throw NoriException("No camera was specified!");
+    if (m_wavefront && !m_integrator->supportsWavefront())
+        throw NoriException("Scene: the integrator does not support wavefront rendering!");
     
     if (!m_sampler) {
         /* Create a default (independent) sampler */
@@ -52,6 +149,27 @@ void Scene::activate() {
             NoriObjectFactory::createInstance("independent", PropertyList()));
     }
 
+    /* Only area emitters exist so far, which must belong to a mesh */
+    for (const Emitter *emitter : m_emitters)
+        if (!emitter->getMesh())
+            throw NoriException("Scene: emitters must be attached to a mesh "
+                "(only area lights are supported)!");
+
+    /* Gather the emissive triangles of all meshes in one table, weighted
+       by the power they emit */
+    std::vector<float> weights;
+    for (const Mesh *mesh : m_meshes) {
+        if (!mesh->isEmitter())
+            continue;
+        m_emitters.push_back(const_cast<Emitter *>(mesh->getEmitter()));
+        float luminance = mesh->getEmitter()->getRadiance().getLuminance();
+        for (uint32_t i = 0; i < mesh->getTriangleCount(); ++i) {
+            m_emitterTriangles.push_back(std::make_pair(mesh, i));
+            weights.push_back(mesh->surfaceArea(i) * luminance);
+        }
+    }
+    m_emitterPDF.build(weights);
+
     cout << endl;
     cout << "Configuration: " << toString() << endl;
     cout << endl;
@@ -66,11 +184,8 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
         
-        case EEmitter: {
-                //Emitter *emitter = static_cast<Emitter *>(obj);
-                /* TBD */
-                throw NoriException("Scene::addChild(): You need to implement this for emitters");
-            }
+        case EEmitter:
+            m_emitters.push_back(static_cast<Emitter *>(obj));
             break;
 
         case ESampler:
@@ -97,6 +212,39 @@ void Scene::addChild(NoriObject *obj) {
     }
 }
 
+Color3f Scene::sampleEmitter(EmitterQueryRecord &lRec, float selection, const Point2f &sample) const {
+    if (m_emitterPDF.size() == 0)
+        return Color3f(0.0f);
+
+    /* Choose a triangle, and a position within it. The position uses its
+       own sample, since reusing the selection would leave only a few bits
+       of precision with a large number of triangles */
+    float pdf;
+    const std::pair<const Mesh *, uint32_t> &triangle =
+        m_emitterTriangles[m_emitterPDF.sample(selection, pdf)];
+
+    Point3f p;
+    Normal3f n;
+    triangle.first->sampleTriangle(triangle.second, sample, p, n);
+    lRec.emitter = triangle.first->getEmitter();
+    lRec.triangle = triangle.second;
+    lRec.setPosition(p, n);
+    lRec.pdf = pdfEmitter(lRec);
+    if (lRec.pdf == 0)
+        return Color3f(0.0f);
+    return lRec.emitter->eval(lRec) / lRec.pdf;
+}
+
+float Scene::pdfEmitter(const EmitterQueryRecord &lRec) const {
+    if (!lRec.emitter || m_emitterPDF.getSum() <= 0)
+        return 0.0f;
+
+    /* The probability of a triangle divided by its area is the
+       same for all triangles of an emitter */
+    return lRec.toSolidAngle(
+        lRec.emitter->getRadiance().getLuminance() / m_emitterPDF.getSum());
+}
+
 std::string Scene::toString() const {
     std::string meshes;
     for (size_t i=0; i<m_meshes.size(); ++i) {
@@ -0,0 +1,165 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Owen-scrambled Sobol sampler
+ *
+ * Every pair of dimensions is sampled from the first two dimensions of the
+ * Sobol sequence, which form a (0, 2)-sequence in base 2. To decorrelate
+ * the dimension pairs and pixels from each other, the sample index is
+ * shuffled and both coordinates are Owen-scrambled using hash-based nested
+ * uniform permutations that are seeded by the pixel and dimension (see
+ * "Practical Hash-based Owen Scrambling" by Brent Burley, JCGT 2020). Each
+ * component is computed from scratch in O(1), which allows random access
+ * to any sample of any pixel.
+ *
+ * The sequence is best stratified when the sample count is a power of two.
+ */
+class Sobol : public Sampler {
+public:
+    Sobol(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~Sobol() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<Sobol> cloned(new Sobol());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        cloned->m_pixel = m_pixel;
+        cloned->m_firstSample = m_firstSample;
+        cloned->m_index = m_index;
+        cloned->m_dimension = m_dimension;
+        return std::move(cloned);
+    }
+
+    void prepare(const ImageBlock &block, size_t firstSample) {
+        m_pixel = block.getOffset();
+        m_firstSample = firstSample;
+        m_index = firstSample;
+        m_dimension = 0;
+    }
+
+    void generate() {
+        m_index = m_firstSample;
+        m_dimension = 0;
+    }
+
+    void advance() {
+        ++m_index;
+        m_dimension = 0;
+    }
+
+    void setSample(const Point2i &pixel, size_t index, uint32_t dimension) {
+        m_pixel = pixel;
+        m_index = m_firstSample + index;
+        m_dimension = dimension;
+    }
+
+    float next1D() {
+        uint32_t seed = dimensionSeed();
+        uint32_t index = scramble((uint32_t) m_index, seed);
+        return toFloat(scramble(reverseBits(index), hash(seed ^ 0x5bd1e995u)));
+    }
+
+    Point2f next2D() {
+        uint32_t seed = dimensionSeed();
+        uint32_t index = scramble((uint32_t) m_index, seed);
+        return Point2f(
+            toFloat(scramble(reverseBits(index), hash(seed ^ 0x5bd1e995u))),
+            toFloat(scramble(sobol2(index), hash(seed ^ 0x27d4eb2du)))
+        );
+    }
+
+    std::string toString() const {
+        return tfm::format("Sobol[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    Sobol() { }
+
+    /// Return a seed for the current pixel and dimension, and advance the dimension
+    uint32_t dimensionSeed() {
+        uint32_t seed = hash(m_seed ^ hash((uint32_t) m_pixel.x() ^
+            hash((uint32_t) m_pixel.y() ^ hash(m_dimension))));
+        m_dimension += 2;
+        return seed;
+    }
+
+    /// Second dimension of the Sobol sequence (the first one is the radical inverse)
+    static uint32_t sobol2(uint32_t index) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+            if (index & 1)
+                result ^= v;
+        }
+        return result;
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    /// Nested uniform (Owen) scrambling of the bits of \c x from the most significant bit down
+    static uint32_t scramble(uint32_t x, uint32_t seed) {
+        /* Laine-Karras style permutation, which only lets bits
+           affect more significant ones, applied in reversed bit order */
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits(x);
+    }
+
+    /// 32-bit integer hash (the finalizer of MurmurHash3)
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x85ebca6bu;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35u;
+        x ^= x >> 16;
+        return x;
+    }
+
+    /// Map the 24 most significant bits to a float in <tt>[0, 1)</tt>
+    static float toFloat(uint32_t x) {
+        return (x >> 8) * (1.f / (1u << 24));
+    }
+
+private:
+    uint32_t m_seed = 0;
+    Point2i m_pixel = Point2i(0, 0);
+    size_t m_firstSample = 0;
+    size_t m_index = 0;
+    uint32_t m_dimension = 0;
+};
+
+NORI_REGISTER_CLASS(Sobol, "sobol");
+NORI_NAMESPACE_END
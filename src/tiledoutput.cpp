@@ -0,0 +1,224 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/tiledoutput.h>
+#include <nori/rfilter.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <filesystem/path.h>
+#include <half.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/// Accumulation buffer and completion state of one output tile
+struct TiledImageOutput::Tile {
+    tbb::mutex mutex;
+    std::vector<Color4f, Eigen::aligned_allocator<Color4f>> data;
+    /// Number of pixels of this tile that have not been rendered yet
+    std::atomic<int> remaining;
+    /// Number of tiles in the neighborhood (including this one) that are incomplete
+    std::atomic<int> pending;
+};
+
+TiledImageOutput::TiledImageOutput(const std::string &filename, const Vector2i &size,
+                                   const ReconstructionFilter *filter,
+                                   Bitmap::ECompression compression, bool halfFloat, int tileSize)
+        : m_filename(filename), m_size(size), m_tileSize(tileSize), m_halfFloat(halfFloat),
+          m_tilesWritten(0), m_memory(0), m_peakMemory(0) {
+    /* Border of the merged image blocks (as in ImageBlock) */
+    m_borderSize = filter ? (int) std::ceil(filter->getRadius() - 0.5f) : 0;
+    if (m_borderSize > tileSize)
+        throw NoriException("TiledImageOutput: the reconstruction filter is "
+            "wider than the tiles of the output file!");
+
+    cout << "Streaming a " << size.x() << "x" << size.y()
+         << " tiled OpenEXR file to \"" << filename << "\" ("
+         << Bitmap::compressionToString(compression) << (halfFloat ? ", half" : "") << ")" << endl;
+    Bitmap::initThreadPool();
+
+    m_tileCount = Vector2i(
+        (size.x() + tileSize - 1) / tileSize,
+        (size.y() + tileSize - 1) / tileSize);
+    m_tiles.reset(new Tile[m_tileCount.prod()]);
+
+    for (int ty=0; ty<m_tileCount.y(); ++ty) {
+        for (int tx=0; tx<m_tileCount.x(); ++tx) {
+            Tile &tile = m_tiles[ty * m_tileCount.x() + tx];
+            tile.remaining = std::min(tileSize, size.x() - tx * tileSize) *
+                             std::min(tileSize, size.y() - ty * tileSize);
+
+            /* With a border, the neighbors contribute to this tile as well */
+            int r = m_borderSize > 0 ? 1 : 0, pending = 0;
+            for (int y=std::max(0, ty-r); y<=std::min(m_tileCount.y()-1, ty+r); ++y)
+                for (int x=std::max(0, tx-r); x<=std::min(m_tileCount.x()-1, tx+r); ++x)
+                    ++pending;
+            tile.pending = pending;
+        }
+    }
+
+    Imf::Header header(size.x(), size.y());
+    header.insert("comments", Imf::StringAttribute("Generated by Nori"));
+    header.setTileDescription(Imf::TileDescription(tileSize, tileSize, Imf::ONE_LEVEL));
+    header.lineOrder() = Imf::RANDOM_Y;
+
+    switch (compression) {
+        case Bitmap::ENoCompression: header.compression() = Imf::NO_COMPRESSION; break;
+        case Bitmap::EZipCompression: header.compression() = Imf::ZIP_COMPRESSION; break;
+        case Bitmap::EPizCompression: header.compression() = Imf::PIZ_COMPRESSION; break;
+        case Bitmap::EDwaaCompression: header.compression() = Imf::DWAA_COMPRESSION; break;
+    }
+
+    Imf::PixelType type = halfFloat ? Imf::HALF : Imf::FLOAT;
+    Imf::ChannelList &channels = header.channels();
+    channels.insert("R", Imf::Channel(type));
+    channels.insert("G", Imf::Channel(type));
+    channels.insert("B", Imf::Channel(type));
+
+    m_file.reset(new Imf::TiledOutputFile(filename.c_str(), header));
+}
+
+TiledImageOutput::~TiledImageOutput() { }
+
+void TiledImageOutput::put(const ImageBlock &block) {
+    /* Region covered by the block including its border, clipped to the image */
+    Point2i offset = block.getOffset() - Vector2i::Constant(block.getBorderSize());
+    Point2i min = offset.cwiseMax(Point2i(0, 0));
+    Point2i max = (block.getOffset() + block.getSize() +
+        Vector2i::Constant(block.getBorderSize())).cwiseMin(m_size);
+    Point2i tileMin = min / m_tileSize, tileMax = (max - Vector2i::Ones()) / m_tileSize;
+
+    for (int ty=tileMin.y(); ty<=tileMax.y(); ++ty) {
+        for (int tx=tileMin.x(); tx<=tileMax.x(); ++tx) {
+            Tile &tile = m_tiles[ty * m_tileCount.x() + tx];
+            Point2i tileOffset(tx * m_tileSize, ty * m_tileSize);
+            Point2i rmin = min.cwiseMax(tileOffset);
+            Point2i rmax = max.cwiseMin(tileOffset + Vector2i::Constant(m_tileSize));
+
+            tbb::mutex::scoped_lock lock(tile.mutex);
+            if (tile.data.empty()) {
+                size_t pixels = (size_t) m_tileSize * m_tileSize;
+                tile.data.resize(pixels);
+                size_t memory = (m_memory += sizeof(Color4f) * pixels);
+                size_t peak = m_peakMemory;
+                while (memory > peak && !m_peakMemory.compare_exchange_weak(peak, memory))
+                    ;
+            }
+
+            for (int y=rmin.y(); y<rmax.y(); ++y) {
+                Color4f *target = tile.data.data() + (y - tileOffset.y()) * m_tileSize;
+                for (int x=rmin.x(); x<rmax.x(); ++x)
+                    target[x - tileOffset.x()] += block.coeff(y - offset.y(), x - offset.x());
+            }
+        }
+    }
+
+    /* Mark the pixels of the block (without the border) as rendered */
+    min = block.getOffset();
+    max = block.getOffset() + block.getSize();
+    tileMin = min / m_tileSize;
+    tileMax = (max - Vector2i::Ones()) / m_tileSize;
+
+    for (int ty=tileMin.y(); ty<=tileMax.y(); ++ty) {
+        for (int tx=tileMin.x(); tx<=tileMax.x(); ++tx) {
+            Point2i tileOffset(tx * m_tileSize, ty * m_tileSize);
+            Vector2i area = max.cwiseMin(tileOffset + Vector2i::Constant(m_tileSize))
+                          - min.cwiseMax(tileOffset);
+            Tile &tile = m_tiles[ty * m_tileCount.x() + tx];
+            if ((tile.remaining -= area.prod()) != 0)
+                continue;
+
+            /* This tile is complete; the neighbors may now be final */
+            int r = m_borderSize > 0 ? 1 : 0;
+            for (int y=std::max(0, ty-r); y<=std::min(m_tileCount.y()-1, ty+r); ++y) {
+                for (int x=std::max(0, tx-r); x<=std::min(m_tileCount.x()-1, tx+r); ++x) {
+                    int index = y * m_tileCount.x() + x;
+                    if (--m_tiles[index].pending == 0)
+                        write(index);
+                }
+            }
+        }
+    }
+}
+
+void TiledImageOutput::write(int index) {
+    Tile &tile = m_tiles[index];
+    int tx = index % m_tileCount.x(), ty = index / m_tileCount.x();
+    Vector2i size = (m_size - Vector2i(tx, ty) * m_tileSize).cwiseMin(
+        Vector2i::Constant(m_tileSize));
+
+    /* Normalize the pixels and release the accumulation buffer */
+    std::unique_ptr<Color3f[]> pixels(new Color3f[size.prod()]);
+    {
+        tbb::mutex::scoped_lock lock(tile.mutex);
+        for (int y=0; y<size.y(); ++y)
+            for (int x=0; x<size.x(); ++x)
+                pixels[y * size.x() + x] = tile.data.empty()
+                    ? Color3f(0.f) : tile.data[y * m_tileSize + x].divideByFilterWeight();
+        if (!tile.data.empty()) {
+            decltype(tile.data)().swap(tile.data);
+            m_memory -= sizeof(Color4f) * m_tileSize * m_tileSize;
+        }
+    }
+
+    /* The frame buffer is addressed in image coordinates */
+    std::unique_ptr<half[]> halfPixels;
+    char *ptr = reinterpret_cast<char *>(pixels.get());
+    size_t compStride = sizeof(float);
+    if (m_halfFloat) {
+        halfPixels.reset(new half[3 * size.prod()]);
+        const float *source = reinterpret_cast<const float *>(pixels.get());
+        for (int i=0; i<3 * size.prod(); ++i)
+            halfPixels[i] = source[i];
+        ptr = reinterpret_cast<char *>(halfPixels.get());
+        compStride = sizeof(half);
+    }
+
+    Imf::PixelType type = m_halfFloat ? Imf::HALF : Imf::FLOAT;
+    size_t pixelStride = 3 * compStride,
+           rowStride = pixelStride * size.x();
+    ptr -= (tx * m_tileSize) * pixelStride + (ty * m_tileSize) * rowStride;
+
+    Imf::FrameBuffer frameBuffer;
+    frameBuffer.insert("R", Imf::Slice(type, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("G", Imf::Slice(type, ptr, pixelStride, rowStride)); ptr += compStride;
+    frameBuffer.insert("B", Imf::Slice(type, ptr, pixelStride, rowStride));
+
+    tbb::mutex::scoped_lock lock(m_fileMutex);
+    m_file->setFrameBuffer(frameBuffer);
+    m_file->writeTile(tx, ty);
+    ++m_tilesWritten;
+}
+
+void TiledImageOutput::close() {
+    if (!m_file)
+        return;
+    if (m_tilesWritten != m_tileCount.prod())
+        throw NoriException("TiledImageOutput: only %i of %i tiles of \"%s\" were rendered!",
+            m_tilesWritten.load(), m_tileCount.prod(), m_filename);
+    m_file.reset();
+
+    cout << "Finished writing \"" << m_filename << "\" ("
+         << memString(filesystem::path(m_filename).file_size()) << ", at most "
+         << memString(m_peakMemory) << " of tiles were in memory)." << endl;
+}
+
+NORI_NAMESPACE_END
@@ -110,6 +110,10 @@ public:
             if (!m_scenes.empty())
                 throw NoriException("Cannot test BSDFs and scenes at the same time!");
 
+            std::vector<Point2f> samples(BATCH_SIZE);
+            std::vector<BSDFQueryRecord> batchRecs(BATCH_SIZE, BSDFQueryRecord(Vector3f(0.0f)));
+            std::vector<Color3f> batchValues(BATCH_SIZE);
+
             /* Test each registered BSDF */
             int ctr = 0;
             for (auto bsdf : m_bsdfs) {
@@ -118,30 +122,50 @@ public:
 
                     cout << "------------------------------------------------------" << endl;
                     cout << "Testing (angle=" << angle << "): " << bsdf->toString() << endl;
-                    ++total;
 
                     BSDFQueryRecord bRec(sphericalDirection(degToRad(angle), 0));
 
                     cout << "Drawing " << m_sampleCount << " samples .. " << endl;
-                    double mean=0, variance = 0;
-                    for (int k=0; k<m_sampleCount; ++k) {
-                        Point2f sample(random.nextFloat(), random.nextFloat());
-                        double result = (double) bsdf->sample(bRec, sample).getLuminance();
-
-                        /* Numerically robust online variance estimation using an
-                           algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-                        double delta = result - mean;
-                        mean += delta / (double) (k+1);
-                        variance += delta * (result - mean);
+
+                    /* The samples are drawn using both the scalar and
+                       the batched interface, which are tested separately */
+                    double mean[2] = { 0, 0 }, variance[2] = { 0, 0 };
+                    for (int k=0; k<m_sampleCount; k += BATCH_SIZE) {
+                        int count = std::min((int) BATCH_SIZE, m_sampleCount - k);
+                        for (int j=0; j<count; ++j)
+                            samples[j] = Point2f(random.nextFloat(), random.nextFloat());
+
+                        std::fill(batchRecs.begin(), batchRecs.begin() + count, bRec);
+                        bsdf->sampleBatch(batchRecs.data(), samples.data(), batchValues.data(), count);
+
+                        for (int j=0; j<count; ++j) {
+                            double result[2] = {
+                                (double) bsdf->sample(bRec, samples[j]).getLuminance(),
+                                (double) batchValues[j].getLuminance()
+                            };
+
+                            /* Numerically robust online variance estimation using an
+                               algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
+                            for (int l=0; l<2; ++l) {
+                                double delta = result[l] - mean[l];
+                                mean[l] += delta / (double) (k+j+1);
+                                variance[l] += delta * (result[l] - mean[l]);
+                            }
+                        }
+                    }
+
+                    for (int l=0; l<2; ++l) {
+                        cout << (l == 0 ? "Scalar" : "Batched") << " sampling: ";
+                        ++total;
+                        variance[l] /= m_sampleCount - 1;
+                        std::pair<bool, std::string>
+                            result = hypothesis::students_t_test(mean[l], variance[l], reference,
+                                m_sampleCount, m_significanceLevel, 2 * (int) m_references.size());
+
+                        if (result.first)
+                            ++passed;
+                        cout << result.second << endl;
                     }
-                    variance /= m_sampleCount - 1;
-                    std::pair<bool, std::string>
-                        result = hypothesis::students_t_test(mean, variance, reference,
-                            m_sampleCount, m_significanceLevel, (int) m_references.size());
-
-                    if (result.first)
-                        ++passed;
-                    cout << result.second << endl;
                 }
             }
         } else {
@@ -208,6 +232,9 @@ public:
 
     EClassType getClassType() const { return ETest; }
 private:
+    /// Number of samples that are drawn at once using the batched interface
+    enum { BATCH_SIZE = 1024 };
+
     std::vector<BSDF *> m_bsdfs;
     std::vector<Scene *> m_scenes;
     std::vector<float> m_angles;
@@ -116,17 +116,16 @@ Point2f squareToUniformDiskConcentric(const Point2f &sample) {
 }
 
 Vector3f Warp::squareToCosineHemisphere(const Point2f &sample) {
-    float theta = 2.0f*M_PI*sample[0];
-    float phi = asinf(M_PI*sample[1]);
-    return Point3f(sinf(phi)*cosf(theta), sinf(phi)*sinf(theta), cosf(phi));
-    // Point2f p = squareToUniformDiskConcentric(sample);
-    // float z = sqrtf(1.0f - p.x()*p.x() - p.y()*p.y());
+    /* Malley's method: project uniformly distributed points
+       on the disk up onto the hemisphere */
+    Point2f p = squareToUniformDiskConcentric(sample);
+    float z = std::sqrt(std::max(0.0f, 1.0f - p.x()*p.x() - p.y()*p.y()));
 
-    // /* Guard against numerical imprecisions */
-    // if (fabs(z) < 1e-5)
-    //     z = 1e-10f;
+    /* Guard against numerical imprecisions */
+    if (z < 1e-5f)
+        z = 1e-5f;
 
-    // return Vector3f(p.x(), p.y(), z);
+    return Vector3f(p.x(), p.y(), z);
 }
 
 float Warp::squareToCosineHemispherePdf(const Vector3f &v) {
@@ -0,0 +1,180 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/wavefront.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+
+NORI_NAMESPACE_BEGIN
+
+WavefrontRenderer::WavefrontRenderer(const Scene *scene, size_t queueSize)
+    : m_scene(scene), m_queueSize(queueSize), m_row(0), m_sample(0) {
+    if (queueSize < NORI_BLOCK_SIZE)
+        throw NoriException("WavefrontRenderer: the queue must hold at least %i paths!",
+            NORI_BLOCK_SIZE);
+    m_paths.reserve(queueSize);
+    m_sorted.reserve(queueSize);
+    m_shadowRays.reserve(queueSize);
+    m_rays.reserve(queueSize);
+    m_hits.reserve(queueSize);
+}
+
+size_t WavefrontRenderer::render(Sampler *sampler, ImageBlock &block, uint32_t sampleCount) {
+    /* Clear the block contents */
+    block.clear();
+    m_paths.clear();
+    m_row = 0;
+    m_sample = 0;
+
+    size_t total = 0;
+    while (true) {
+        total += generate(sampler, block, sampleCount);
+        if (m_paths.empty())
+            break;
+
+        intersect();
+        sort();
+        shade(sampler);
+        traceShadowRays();
+        accumulate(block);
+    }
+
+    return total;
+}
+
+size_t WavefrontRenderer::generate(Sampler *sampler, const ImageBlock &block, uint32_t sampleCount) {
+    const Camera *camera = m_scene->getCamera();
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
+
+    Point2i pixels[NORI_BLOCK_SIZE];
+    float cameraSamples[4 * NORI_BLOCK_SIZE];
+    size_t generated = 0;
+
+    /* Camera rays are generated one sample of one row of pixels at a time */
+    while (m_row < size.y() && m_paths.size() + size.x() <= m_queueSize) {
+        for (int x=0; x<size.x(); ++x)
+            pixels[x] = Point2i(x + offset.x(), m_row + offset.y());
+        sampler->nextBatch(pixels, (size_t) size.x(), m_sample, 4, cameraSamples);
+
+        for (int x=0; x<size.x(); ++x) {
+            const float *sample = cameraSamples + 4 * x;
+            Point2f pixelSample = Point2f(pixels[x].cast<float>()) + Point2f(sample[0], sample[1]);
+            Point2f apertureSample(sample[2], sample[3]);
+
+            /* Sample a ray from the camera (which used the
+               first four dimensions of the sample) */
+            Ray3f ray;
+            Color3f weight = camera->sampleRay(ray, pixelSample, apertureSample);
+
+            m_paths.emplace_back(ray, weight);
+            PathState &path = m_paths.back();
+            path.pixelSample = pixelSample;
+            path.pixel = pixels[x];
+            path.sampleIndex = m_sample;
+            path.dimension = 4;
+        }
+        generated += (size_t) size.x();
+
+        if (++m_sample == sampleCount) {
+            m_sample = 0;
+            ++m_row;
+        }
+    }
+
+    return generated;
+}
+
+void WavefrontRenderer::intersect() {
+    size_t count = m_paths.size();
+    m_rays.resize(count);
+    m_hits.resize(count);
+    for (size_t i=0; i<count; ++i)
+        m_rays[i] = m_paths[i].ray;
+
+    m_scene->rayIntersect(m_rays.data(), m_hits.data(), count);
+
+    for (size_t i=0; i<count; ++i)
+        m_paths[i].hit = m_hits[i];
+}
+
+void WavefrontRenderer::sort() {
+    /* Counting sort by mesh index, which keeps the order of the paths
+       within a mesh. Paths that missed the scene go into the last group */
+    uint32_t meshCount = (uint32_t) m_scene->getMeshes().size();
+    auto group = [meshCount](const PathState &path) {
+        return path.hit.isValid() ? path.hit.mesh : meshCount;
+    };
+
+    m_offsets.assign(meshCount + 2, 0u);
+    for (const PathState &path : m_paths)
+        m_offsets[group(path) + 1]++;
+    for (uint32_t i=1; i<meshCount + 2; ++i)
+        m_offsets[i] += m_offsets[i-1];
+
+    m_sorted.resize(m_paths.size());
+    std::vector<uint32_t> cursor(m_offsets.begin(), m_offsets.end() - 1);
+    for (const PathState &path : m_paths)
+        m_sorted[cursor[group(path)]++] = path;
+    m_paths.swap(m_sorted);
+}
+
+void WavefrontRenderer::shade(Sampler *sampler) {
+    const Integrator *integrator = m_scene->getIntegrator();
+    uint32_t meshCount = (uint32_t) m_scene->getMeshes().size();
+
+    m_shadowRays.clear();
+    for (uint32_t i=0; i<meshCount; ++i) {
+        uint32_t start = m_offsets[i], end = m_offsets[i+1];
+        if (start != end)
+            integrator->shade(m_scene, sampler, m_paths.data() + start,
+                              end - start, m_shadowRays);
+    }
+
+    /* Nori has no environment emitters -- paths that
+       missed the scene receive no further radiance */
+    for (uint32_t i=m_offsets[meshCount]; i<m_offsets[meshCount+1]; ++i)
+        m_paths[i].alive = false;
+}
+
+void WavefrontRenderer::traceShadowRays() {
+    for (const ShadowRay &shadowRay : m_shadowRays) {
+        if (!m_scene->rayIntersect(shadowRay.ray))
+            shadowRay.path->radiance += shadowRay.contribution;
+    }
+    m_shadowRays.clear();
+}
+
+void WavefrontRenderer::accumulate(ImageBlock &block) {
+    size_t remaining = 0;
+    for (size_t i=0; i<m_paths.size(); ++i) {
+        PathState &path = m_paths[i];
+        if (path.alive) {
+            if (remaining != i)
+                m_paths[remaining] = path;
+            ++remaining;
+        } else {
+            block.put(path.pixelSample, path.weight * path.radiance);
+        }
+    }
+    m_paths.resize(remaining);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,195 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/integrator.h>
+#include <nori/sampler.h>
+#include <nori/wavefront.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Consistency test of the wavefront renderer
+ *
+ * Every block of each scene is rendered twice: once by tracing one path
+ * at a time through \ref Integrator::LiPrimary() (like the default
+ * renderer), and once by the \ref WavefrontRenderer. The scenes should use
+ * a sampler that depends on the pixel, sample index and dimension (e.g.
+ * \c sobol). Both renderers then see exactly the same sample components,
+ * and the resulting blocks must agree up to roundoff. This catches
+ * integrators that do not consume the number of sample dimensions per
+ * path vertex that they announce to the wavefront renderer.
+ */
+class WavefrontTest : public NoriObject {
+public:
+    WavefrontTest(const PropertyList &propList) {
+        /* Largest relative difference of a pixel that is still considered equal */
+        m_tolerance = propList.getFloat("tolerance", 1e-3f);
+
+        /* A small fraction of the pixels may differ, since the batched and the
+           scalar ray intersection can disagree on grazing hits */
+        m_maxMismatches = propList.getFloat("maxMismatches", 0.01f);
+
+        /* Number of paths in flight in the wavefront renderer */
+        m_queueSize = propList.getInteger("queueSize", 8192);
+    }
+
+    virtual ~WavefrontTest() {
+        for (auto scene : m_scenes)
+            delete scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                m_scenes.push_back(static_cast<Scene *>(obj));
+                break;
+
+            default:
+                throw NoriException("WavefrontTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Render each scene with both renderers and compare the results
+    void activate() {
+        int total = 0, passed = 0;
+
+        for (auto scene : m_scenes) {
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing scene: " << scene->toString() << endl;
+            ++total;
+
+            if (!scene->getIntegrator()->supportsWavefront()) {
+                cout << "Failed: the integrator does not support wavefront rendering." << endl;
+                continue;
+            }
+            scene->getIntegrator()->preprocess(scene);
+
+            const Camera *camera = scene->getCamera();
+            uint32_t sampleCount = (uint32_t) scene->getSampler()->getSampleCount();
+            BlockGenerator blockGenerator(camera->getOutputSize(), NORI_BLOCK_SIZE);
+            ImageBlock reference(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+            ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+            WavefrontRenderer wavefront(scene, (size_t) m_queueSize);
+
+            cout << "Rendering " << blockGenerator.getBlockCount() << " blocks with "
+                 << sampleCount << " samples per pixel twice .. ";
+            cout.flush();
+
+            size_t pixels = 0, mismatches = 0;
+            while (blockGenerator.next(block)) {
+                reference.setOffset(block.getOffset());
+                reference.setSize(block.getSize());
+
+                sampler->prepare(reference, 0);
+                renderReference(scene, sampler.get(), reference, sampleCount);
+                sampler->prepare(block, 0);
+                wavefront.render(sampler.get(), block, sampleCount);
+
+                for (int y=0; y<block.rows(); ++y) {
+                    for (int x=0; x<block.cols(); ++x) {
+                        const Color4f &a = reference.coeff(y, x), &b = block.coeff(y, x);
+                        bool equal = true;
+                        for (int i=0; i<4; ++i) {
+                            float scale = std::max(std::abs(a[i]), std::abs(b[i]));
+                            if (std::abs(a[i] - b[i]) > m_tolerance * scale + 1e-6f)
+                                equal = false;
+                        }
+                        mismatches += equal ? 0 : 1;
+                        ++pixels;
+                    }
+                }
+            }
+            cout << "done." << endl;
+
+            float fraction = mismatches / (float) pixels;
+            bool success = fraction <= m_maxMismatches;
+            cout << tfm::format("%s: %i of %i pixels differ (%.4f%%, at most %.4f%% allowed).",
+                success ? "Passed" : "Failed", mismatches, pixels,
+                100 * fraction, 100 * m_maxMismatches) << endl;
+            if (success)
+                ++passed;
+        }
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "WavefrontTest[\n"
+            "  tolerance = %f,\n"
+            "  maxMismatches = %f,\n"
+            "  queueSize = %i\n"
+            "]",
+            m_tolerance,
+            m_maxMismatches,
+            m_queueSize
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    /// Render a block one path at a time, using the same sample dimensions as the default renderer
+    static void renderReference(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                                uint32_t sampleCount) {
+        const Camera *camera = scene->getCamera();
+        const Integrator *integrator = scene->getIntegrator();
+        Point2i offset = block.getOffset();
+        Vector2i size = block.getSize();
+
+        block.clear();
+        Point2i pixels[NORI_BLOCK_SIZE];
+        float cameraSamples[4 * NORI_BLOCK_SIZE];
+
+        for (int y=0; y<size.y(); ++y) {
+            for (int x=0; x<size.x(); ++x)
+                pixels[x] = Point2i(x + offset.x(), y + offset.y());
+
+            for (uint32_t i=0; i<sampleCount; ++i) {
+                sampler->nextBatch(pixels, (size_t) size.x(), i, 4, cameraSamples);
+
+                for (int x=0; x<size.x(); ++x) {
+                    const float *sample = cameraSamples + 4 * x;
+                    Point2f pixelSample = Point2f(pixels[x].cast<float>()) + Point2f(sample[0], sample[1]);
+                    Point2f apertureSample(sample[2], sample[3]);
+
+                    Ray3f ray;
+                    Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+
+                    /* The camera ray used the first four dimensions of the sample */
+                    HitRecord hit;
+                    scene->rayIntersect(ray, hit);
+                    sampler->setSample(pixels[x], i, 4);
+                    value *= integrator->LiPrimary(scene, sampler, ray, hit);
+
+                    block.put(pixelSample, value);
+                }
+            }
+        }
+    }
+
+    std::vector<Scene *> m_scenes;
+    float m_tolerance;
+    float m_maxMismatches;
+    int m_queueSize;
+};
+
+NORI_REGISTER_CLASS(WavefrontTest, "wavefronttest");
+NORI_NAMESPACE_END